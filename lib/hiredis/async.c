@@ -36,6 +36,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/time.h>
+#include <time.h>
 #include "async.h"
 #include "net.h"
 #include "dict.c"
@@ -130,12 +132,14 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     ac->onConnect = NULL;
     ac->onDisconnect = NULL;
 
-    ac->replies.head = NULL;
-    ac->replies.tail = NULL;
-    ac->sub.invalid.head = NULL;
-    ac->sub.invalid.tail = NULL;
+    memset(&ac->replies,0,sizeof(ac->replies));
+    memset(&ac->sub.invalid,0,sizeof(ac->sub.invalid));
     ac->sub.channels = dictCreate(&callbackDict,NULL);
     ac->sub.patterns = dictCreate(&callbackDict,NULL);
+
+    memset(&ac->batch,0,sizeof(ac->batch));
+    memset(&ac->wm,0,sizeof(ac->wm));
+    memset(&ac->discard,0,sizeof(ac->discard));
     return ac;
 }
 
@@ -201,41 +205,68 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
 
 /* Helper functions to push/shift callbacks */
 static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
-    redisCallback *cb;
+    redisCallback *cbs, *cb;
+    size_t cap, j;
 
-    /* Copy callback from stack to heap */
-    cb = malloc(sizeof(*cb));
-    if (cb == NULL)
-        return REDIS_ERR_OOM;
+    /* Nothing to run for this reply, just remember to skip it */
+    if (source == NULL || source->fn == NULL) {
+        list->skip++;
+        list->pending++;
+        return REDIS_OK;
+    }
 
-    if (source != NULL) {
-        memcpy(cb,source,sizeof(*cb));
-        cb->next = NULL;
+    /* Grow the ring, unwrapping it in the new one */
+    if (list->count == list->cap) {
+        cap = list->cap ? list->cap*2 : REDIS_CALLBACKS_MIN;
+        cbs = malloc(cap*sizeof(*cbs));
+        if (cbs == NULL)
+            return REDIS_ERR_OOM;
+        for (j = 0; j < list->count; j++)
+            cbs[j] = list->cbs[(list->first+j) % list->cap];
+        free(list->cbs);
+        list->cbs = cbs;
+        list->cap = cap;
+        list->first = 0;
     }
 
-    /* Store callback in list */
-    if (list->head == NULL)
-        list->head = cb;
-    if (list->tail != NULL)
-        list->tail->next = cb;
-    list->tail = cb;
+    cb = &list->cbs[(list->first+list->count) % list->cap];
+    cb->fn = source->fn;
+    cb->privdata = source->privdata;
+    cb->skip = list->skip;
+    list->skip = 0;
+    list->count++;
+    list->pending++;
     return REDIS_OK;
 }
 
+/* Shift the callback of the next reply. Skipped replies get an empty one. */
 static int __redisShiftCallback(redisCallbackList *list, redisCallback *target) {
-    redisCallback *cb = list->head;
-    if (cb != NULL) {
-        list->head = cb->next;
-        if (cb == list->tail)
-            list->tail = NULL;
-
-        /* Copy callback from heap to stack */
-        if (target != NULL)
-            memcpy(target,cb,sizeof(*cb));
-        free(cb);
+    redisCallback *cb;
+
+    if (list->pending == 0)
+        return REDIS_ERR;
+    list->pending--;
+
+    cb = list->count ? &list->cbs[list->first] : NULL;
+    if (cb == NULL || cb->skip > 0) {
+        if (cb != NULL)
+            cb->skip--;
+        else
+            list->skip--;
+        if (target != NULL) {
+            target->skip = 0;
+            target->fn = NULL;
+            target->privdata = NULL;
+        }
         return REDIS_OK;
     }
-    return REDIS_ERR;
+
+    /* Copy callback out of the ring */
+    if (target != NULL)
+        memcpy(target,cb,sizeof(*cb));
+    list->first = (list->first+1) % list->cap;
+    list->count--;
+    return REDIS_OK;
 }
 
 static void __redisRunCallback(redisAsyncContext *ac, redisCallback *cb, redisReply *reply) {
@@ -261,6 +292,8 @@ static void __redisAsyncFree(redisAsyncContext *ac) {
     /* Execute callbacks for invalid commands */
     while (__redisShiftCallback(&ac->sub.invalid,&cb) == REDIS_OK)
         __redisRunCallback(ac,&cb,NULL);
+    free(ac->replies.cbs);
+    free(ac->sub.invalid.cbs);
 
     /* Run subscription callbacks callbacks with NULL reply */
     it = dictGetIterator(ac->sub.channels);
@@ -333,10 +366,29 @@ static void __redisAsyncDisconnect(redisAsyncContext *ac) {
 void redisAsyncDisconnect(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     c->flags |= REDIS_DISCONNECTING;
-    if (!(c->flags & REDIS_IN_CALLBACK) && ac->replies.head == NULL)
+    if (!(c->flags & REDIS_IN_CALLBACK) && ac->replies.pending == 0)
         __redisAsyncDisconnect(ac);
 }
 
+/* Find the callback of a channel or pattern straight from the reply bytes,
+ * hashing and comparing like callbackHash and callbackKeyCompare without
+ * building an sds key first. */
+static dictEntry *__redisFindSubscribeCallback(dict *callbacks, const char *name, size_t len) {
+    dictEntry *de;
+
+    if (callbacks->size == 0)
+        return NULL;
+
+    de = callbacks->table[dictGenHashFunction((const unsigned char *)name,(int)len) &
+                          callbacks->sizemask];
+    while (de != NULL) {
+        if (sdslen((const sds)de->key) == len && memcmp(de->key,name,len) == 0)
+            return de;
+        de = de->next;
+    }
+    return NULL;
+}
+
 static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply, redisCallback *dstcb) {
     redisContext *c = &(ac->c);
     dict *callbacks;
@@ -360,14 +412,19 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
 
         /* Locate the right callback */
         assert(reply->element[1]->type == REDIS_REPLY_STRING);
-        sname = sdsnewlen(reply->element[1]->str,reply->element[1]->len);
-        de = dictFind(callbacks,sname);
+        de = __redisFindSubscribeCallback(callbacks,reply->element[1]->str,
+                                          reply->element[1]->len);
         if (de != NULL) {
             memcpy(dstcb,dictGetEntryVal(de),sizeof(*dstcb));
 
-            /* If this is an unsubscribe message, remove it. */
-            if (strcasecmp(stype+pvariant,"unsubscribe") == 0) {
+            /* If this is an unsubscribe message, remove it. Messages never
+             * have the length of "unsubscribe" and skip the comparison. */
+            if (reply->element[0]->len == 11+pvariant &&
+                strcasecmp(stype+pvariant,"unsubscribe") == 0)
+            {
+                sname = sdsnewlen(reply->element[1]->str,reply->element[1]->len);
                 dictDelete(callbacks,sname);
+                sdsfree(sname);
 
                 /* If this was the last unsubscribe message, revert to
                  * non-subscribe mode. */
@@ -376,7 +433,6 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
                     c->flags &= ~REDIS_SUBSCRIBED;
             }
         }
-        sdsfree(sname);
     } else {
         /* Shift callback for invalid commands. */
         __redisShiftCallback(&ac->sub.invalid,dstcb);
@@ -384,17 +440,53 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
     return REDIS_OK;
 }
 
+/* Replies that come first in the queue and have no callback. */
+static unsigned long __redisSkippedFirst(redisCallbackList *list) {
+    return list->count ? list->cbs[list->first].skip : list->skip;
+}
+
+/* Get the next reply. In discard mode, the replies coming up without a
+ * callback are parsed but not built, and their callbacks shifted here.
+ * Monitor and pub/sub messages can come in ahead of those replies, so a
+ * monitoring or subscribed context never discards. */
+static int __redisAsyncGetReply(redisAsyncContext *ac, void **reply) {
+    redisContext *c = &(ac->c);
+    redisReader *r = c->reader;
+    unsigned long long discarded = r->discarded;
+    int status;
+
+    if (ac->discard.enabled && r->ridx == -1 && r->discard == 0 &&
+        !(c->flags & (REDIS_MONITORING | REDIS_SUBSCRIBED)))
+        redisReaderDiscard(r,__redisSkippedFirst(&ac->replies));
+
+    status = redisGetReply(c,reply);
+    for (; discarded < r->discarded; discarded++) {
+        __redisShiftCallback(&ac->replies,NULL);
+        ac->discard.replies++;
+    }
+    return status;
+}
+
+/* Account for a reply nobody waited for before it is freed. */
+static void __redisAsyncSkipReply(redisAsyncContext *ac, redisReply *reply) {
+    ac->discard.replies++;
+    if (reply->type == REDIS_REPLY_ERROR) {
+        ac->discard.errors++;
+        snprintf(ac->discard.errstr,sizeof(ac->discard.errstr),"%s",reply->str);
+    }
+}
+
 void redisProcessCallbacks(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisCallback cb;
     void *reply = NULL;
     int status;
 
-    while((status = redisGetReply(c,&reply)) == REDIS_OK) {
+    while((status = __redisAsyncGetReply(ac,&reply)) == REDIS_OK) {
         if (reply == NULL) {
             /* When the connection is being disconnected and there are
              * no more replies, this is the cue to really disconnect. */
-            if (c->flags & REDIS_DISCONNECTING && sdslen(c->obuf) == 0) {
+            if (c->flags & REDIS_DISCONNECTING && c->ocount == 0) {
                 __redisAsyncDisconnect(ac);
                 return;
             }
@@ -453,6 +545,7 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
              * or there were no callbacks to begin with. Either way, don't
              * abort with an error, but simply ignore it because the client
              * doesn't know what the server will spit out over the wire. */
+            __redisAsyncSkipReply(ac,reply);
             c->reader->fn->freeObject(reply);
         }
     }
@@ -508,10 +601,71 @@ void redisAsyncHandleRead(redisAsyncContext *ac) {
     }
 }
 
+/* Microseconds on the monotonic clock, only ever used for differences, so
+ * adjustments of the wall clock never show in the histograms. */
+static long long __redisAsyncUstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((long long)ts.tv_sec)*1000000+ts.tv_nsec/1000;
+}
+
+/* Index of the power-of-two histogram bucket that counts "v". */
+static int __redisBatchBucket(unsigned long long v) {
+    int i = 0;
+    while (v != 0 && i < REDIS_BATCH_BUCKETS-1) {
+        v >>= 1;
+        i++;
+    }
+    return i;
+}
+
+/* Write as much of the pending output as the socket takes, and account for
+ * it in the batch histograms. */
+static int __redisAsyncWrite(redisAsyncContext *ac, int *done) {
+    redisContext *c = &(ac->c);
+    size_t pending = c->opending;
+    long long now, waited;
+
+    if (redisBufferWrite(c,done) == REDIS_ERR)
+        return REDIS_ERR;
+
+    if (ac->batch.enabled && c->opending < pending) {
+        now = __redisAsyncUstime();
+        waited = ac->batch.since ? now-ac->batch.since : 0;
+        ac->batch.flushes++;
+        ac->batch.bytes[__redisBatchBucket(pending-c->opending)]++;
+        ac->batch.latency[__redisBatchBucket(waited > 0 ? waited : 0)]++;
+
+        /* What is left still waits since the same command. */
+        if (c->opending == 0)
+            ac->batch.since = 0;
+    }
+
+    if (ac->wm.congested && c->opending <= ac->wm.low) {
+        ac->wm.congested = 0;
+        ac->wm.drained = 1;
+    }
+    return REDIS_OK;
+}
+
+/* Run the drain callback when the queue went under the low watermark. This
+ * is only done from the event loop or redisAsyncFlush, never while a command
+ * is being appended, so the callback can queue more commands. */
+static void __redisAsyncDrained(redisAsyncContext *ac) {
+    if (!ac->wm.drained)
+        return;
+    ac->wm.drained = 0;
+    if (ac->wm.fn != NULL)
+        ac->wm.fn(ac,ac->wm.privdata);
+}
+
 void redisAsyncHandleWrite(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     int done = 0;
 
+    /* The event is not armed anymore once it fired. */
+    ac->batch.scheduled = 0;
+
     if (!(c->flags & REDIS_CONNECTED)) {
         /* Abort connect was not successful. */
         if (__redisAsyncHandleConnect(ac) != REDIS_OK)
@@ -521,17 +675,126 @@ void redisAsyncHandleWrite(redisAsyncContext *ac) {
             return;
     }
 
-    if (redisBufferWrite(c,&done) == REDIS_ERR) {
+    if (__redisAsyncWrite(ac,&done) == REDIS_ERR) {
         __redisAsyncDisconnect(ac);
     } else {
         /* Continue writing when not done, stop writing otherwise */
-        if (!done)
+        if (!done) {
+            ac->batch.scheduled = 1;
             _EL_ADD_WRITE(ac);
-        else
+        } else {
             _EL_DEL_WRITE(ac);
+        }
 
         /* Always schedule reads after writes */
         _EL_ADD_READ(ac);
+        __redisAsyncDrained(ac);
+    }
+}
+
+int redisAsyncSetDiscard(redisAsyncContext *ac, int enable) {
+    ac->discard.enabled = enable ? 1 : 0;
+
+    /* Replies the reader was told to discard are built again instead */
+    if (!enable)
+        redisReaderDiscard(ac->c.reader,0);
+    return REDIS_OK;
+}
+
+int redisAsyncSetBatching(redisAsyncContext *ac, int enable, size_t maxBytes, long long maxDelay) {
+    ac->batch.enabled = enable ? 1 : 0;
+    ac->batch.maxBytes = maxBytes;
+    ac->batch.maxDelay = maxDelay;
+    ac->batch.since = 0;
+    return REDIS_OK;
+}
+
+int redisAsyncSetWatermarks(redisAsyncContext *ac, size_t high, size_t low, redisDrainCallback *fn, void *privdata) {
+    if (high != 0 && low >= high)
+        return REDIS_ERR;
+    ac->wm.high = high;
+    ac->wm.low = low;
+    ac->wm.congested = high != 0 && ac->c.opending >= high;
+    ac->wm.drained = 0;
+    ac->wm.fn = fn;
+    ac->wm.privdata = privdata;
+    return REDIS_OK;
+}
+
+int redisAsyncIsCongested(const redisAsyncContext *ac) {
+    return ac->wm.congested;
+}
+
+/* Same as redisAsyncFlush without the drain callback, for use while a
+ * command is being appended. */
+static int __redisAsyncFlush(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    int done = 0;
+
+    /* The first write event completes the connection, wait for it. */
+    if (!(c->flags & REDIS_CONNECTED))
+        return REDIS_OK;
+
+    if (__redisAsyncWrite(ac,&done) == REDIS_ERR) {
+        /* Disconnecting here would run callbacks under the caller's feet.
+         * The write event fails the same way and disconnects instead. */
+        if (!ac->batch.scheduled) {
+            ac->batch.scheduled = 1;
+            _EL_ADD_WRITE(ac);
+        }
+        return REDIS_ERR;
+    }
+
+    if (done) {
+        ac->batch.scheduled = 0;
+        _EL_DEL_WRITE(ac);
+    } else if (!ac->batch.scheduled) {
+        ac->batch.scheduled = 1;
+        _EL_ADD_WRITE(ac);
+    }
+    _EL_ADD_READ(ac);
+    return REDIS_OK;
+}
+
+int redisAsyncFlush(redisAsyncContext *ac) {
+    if (__redisAsyncFlush(ac) == REDIS_ERR)
+        return REDIS_ERR;
+    __redisAsyncDrained(ac);
+    return REDIS_OK;
+}
+
+/* Called every time a command was appended to the output buffer. */
+static void __redisAsyncScheduleWrite(redisAsyncContext *ac) {
+    redisContext *c = &(ac->c);
+    long long now = 0;
+
+    if (ac->wm.high && !ac->wm.congested && c->opending >= ac->wm.high) {
+        ac->wm.congested = 1;
+        ac->wm.congestions++;
+    }
+
+    if (!ac->batch.enabled) {
+        /* Always schedule a write when the write buffer is non-empty */
+        _EL_ADD_WRITE(ac);
+        return;
+    }
+
+    if (ac->batch.since == 0 || ac->batch.maxDelay)
+        now = __redisAsyncUstime();
+    if (ac->batch.since == 0)
+        ac->batch.since = now;
+
+    if ((ac->batch.maxBytes && c->opending >= ac->batch.maxBytes) ||
+        (ac->batch.maxDelay && now-ac->batch.since >= ac->batch.maxDelay)) {
+        __redisAsyncFlush(ac);
+        if (c->opending == 0)
+            return;
+    }
+
+    /* One armed write event covers everything queued until it fires. */
+    if (!ac->batch.scheduled) {
+        ac->batch.scheduled = 1;
+        _EL_ADD_WRITE(ac);
     }
 }
 
@@ -567,6 +830,7 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING)) return REDIS_ERR;
 
     /* Setup callback */
+    cb.skip = 0;
     cb.fn = fn;
     cb.privdata = privdata;
 
@@ -612,8 +876,7 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
 
     __redisAppendCommand(c,cmd,len);
 
-    /* Always schedule a write when the write buffer is non-empty */
-    _EL_ADD_WRITE(ac);
+    __redisAsyncScheduleWrite(ac);
 
     return REDIS_OK;
 }
@@ -646,3 +909,62 @@ int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *priv
     free(cmd);
     return status;
 }
+
+/* Regular commands only: the command is not inspected, so it should not be a
+ * (P)(UN)SUBSCRIBE or MONITOR. The callback is registered only after the
+ * command was queued, so "buf" is still owned by the caller on REDIS_ERR. */
+int redisAsyncCommandArgvNoCopy(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen,
+                                const char *buf, size_t len, redisReleaseFn *release, void *releasePrivdata) {
+    redisContext *c = &(ac->c);
+    redisCallback cb;
+
+    /* Don't accept new commands when the connection is about to be closed. */
+    if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING)) return REDIS_ERR;
+
+    /* Replies on a subscribed context can't be matched to this command. */
+    if (c->flags & REDIS_SUBSCRIBED) return REDIS_ERR;
+
+    if (redisAppendCommandArgvNoCopy(c,argc,argv,argvlen,buf,len,release,releasePrivdata) != REDIS_OK)
+        return REDIS_ERR;
+
+    cb.skip = 0;
+    cb.fn = fn;
+    cb.privdata = privdata;
+    __redisPushCallback(&ac->replies,&cb);
+
+    __redisAsyncScheduleWrite(ac);
+
+    return REDIS_OK;
+}
+
+int redisvAsyncCommandTemplate(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisCommandTemplate *t, va_list ap) {
+    redisContext *c = &(ac->c);
+    redisCallback cb;
+
+    /* Don't accept new commands when the connection is about to be closed. */
+    if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING)) return REDIS_ERR;
+
+    /* Replies on a subscribed context can't be matched to this command. */
+    if (c->flags & REDIS_SUBSCRIBED) return REDIS_ERR;
+
+    if (redisvAppendTemplate(c,t,ap) != REDIS_OK)
+        return REDIS_ERR;
+
+    cb.skip = 0;
+    cb.fn = fn;
+    cb.privdata = privdata;
+    __redisPushCallback(&ac->replies,&cb);
+
+    __redisAsyncScheduleWrite(ac);
+
+    return REDIS_OK;
+}
+
+int redisAsyncCommandTemplate(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisCommandTemplate *t, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,t);
+    status = redisvAsyncCommandTemplate(ac,fn,privdata,t,ap);
+    va_end(ap);
+    return status;
+}
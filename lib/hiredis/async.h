@@ -43,20 +43,37 @@ struct dict; /* dictionary header is included in async.c */
 /* Reply callback prototype and container */
 typedef void (redisCallbackFn)(struct redisAsyncContext*, void*, void*);
 typedef struct redisCallback {
-    struct redisCallback *next; /* simple singly linked list */
+    unsigned int skip; /* Fire-and-forget replies that come before this one */
     redisCallbackFn *fn;
     void *privdata;
 } redisCallback;
 
-/* List of callbacks for either regular replies or pub/sub */
+/* Callbacks a fresh queue makes room for */
+#define REDIS_CALLBACKS_MIN 16
+
+/* Queue of callbacks for either regular replies or pub/sub, kept in a ring
+ * that only grows. Commands without a callback are not queued at all, they
+ * are counted in "skip" of the callback queued after them, or in the list's
+ * own "skip" when none was queued yet. */
 typedef struct redisCallbackList {
-    redisCallback *head, *tail;
+    redisCallback *cbs;
+    size_t cap, first, count; /* Ring size, oldest callback, callbacks */
+    unsigned int skip; /* Fire-and-forget replies after the last callback */
+    size_t pending; /* Replies expected, skipped ones included */
 } redisCallbackList;
 
+/* Number of power-of-two buckets in the batching histograms. Bucket i counts
+ * values in [2^(i-1), 2^i), bucket 0 counts zeroes and the last one collects
+ * everything that does not fit. */
+#define REDIS_BATCH_BUCKETS 32
+
 /* Connection callback prototypes */
 typedef void (redisDisconnectCallback)(const struct redisAsyncContext*, int status);
 typedef void (redisConnectCallback)(const struct redisAsyncContext*, int status);
 
+/* Called when queued output fell back under the low watermark */
+typedef void (redisDrainCallback)(struct redisAsyncContext*, void *privdata);
+
 /* Context for an async connection to Redis */
 typedef struct redisAsyncContext {
     /* Hold the regular context, so it can be realloc'ed. */
@@ -98,6 +115,40 @@ typedef struct redisAsyncContext {
         struct dict *channels;
         struct dict *patterns;
     } sub;
+
+    /* Command batching, see redisAsyncSetBatching */
+    struct {
+        int enabled;
+        int scheduled; /* A write event is already armed */
+        size_t maxBytes; /* Flush inline once this much is pending, 0 = off */
+        long long maxDelay; /* Same for the age of the oldest command, in usec */
+        long long since; /* When the oldest unwritten command was queued */
+
+        /* Every flush: bytes handed to the socket and how long the oldest
+         * of them waited, in usec. */
+        unsigned long long flushes;
+        unsigned long long bytes[REDIS_BATCH_BUCKETS];
+        unsigned long long latency[REDIS_BATCH_BUCKETS];
+    } batch;
+
+    /* Replies without a callback, see redisAsyncSetDiscard */
+    struct {
+        int enabled;
+        unsigned long long replies; /* Skipped, built or not */
+        unsigned long long errors; /* Error replies among them */
+        char errstr[128]; /* The last of those errors */
+    } discard;
+
+    /* Output watermarks, see redisAsyncSetWatermarks */
+    struct {
+        size_t high; /* Congested once this much is pending, 0 = off */
+        size_t low; /* Drained again at or under this */
+        int congested;
+        int drained; /* Went under low, the callback did not run yet */
+        redisDrainCallback *fn;
+        void *privdata;
+        unsigned long long congestions; /* Times the queue went over high */
+    } wm;
 } redisAsyncContext;
 
 /* Functions that proxy to hiredis */
@@ -108,16 +159,55 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
 void redisAsyncDisconnect(redisAsyncContext *ac);
 void redisAsyncFree(redisAsyncContext *ac);
 
+/* Batch commands: instead of scheduling a write for every command, the write
+ * event is armed once and everything queued until it fires goes out in a
+ * single write, normally at the end of the current event loop iteration.
+ * The batch is written right away when "maxBytes" bytes are pending or the
+ * oldest command waited "maxDelay" microseconds; 0 disables either limit. */
+int redisAsyncSetBatching(redisAsyncContext *ac, int enable, size_t maxBytes, long long maxDelay);
+
+/* Parse the replies of commands sent without a callback, but don't build
+ * them, for connections that mostly publish. Errors are still built: they
+ * are counted in ac->discard with the last message kept, both with and
+ * without this mode. Errors inside a discarded array are not seen.
+ * The mode has no effect while the context is subscribed or monitoring:
+ * messages arrive unannounced and could be taken for a discarded reply, so
+ * every reply is built as usual until the context leaves that state. */
+int redisAsyncSetDiscard(redisAsyncContext *ac, int enable);
+
+/* Bound the output queue: the context is congested once "high" bytes are
+ * pending and stays so until the socket took everything but "low" bytes.
+ * Nothing is refused while congested, it is up to the caller to check
+ * redisAsyncIsCongested and hold back. "fn" is called from the write event
+ * (or redisAsyncFlush) when the context is not congested anymore. */
+int redisAsyncSetWatermarks(redisAsyncContext *ac, size_t high, size_t low, redisDrainCallback *fn, void *privdata);
+int redisAsyncIsCongested(const redisAsyncContext *ac);
+
+/* Write whatever is pending now instead of waiting for the write event. */
+int redisAsyncFlush(redisAsyncContext *ac);
+
 /* Handle read/write events */
 void redisAsyncHandleRead(redisAsyncContext *ac);
 void redisAsyncHandleWrite(redisAsyncContext *ac);
 
 /* Command functions for an async context. Write the command to the
- * output buffer and register the provided callback. */
+ * output buffer and register the provided callback. A NULL callback makes
+ * the command fire-and-forget: its reply is only counted and skipped. */
 int redisvAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
 int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *format, ...);
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
 
+/* Same as redisAsyncCommandArgv, but "buf" is appended to the last argument
+ * without being copied. "release" is called with the buffer once it has been
+ * written to the socket, or when the context is freed before that. */
+int redisAsyncCommandArgvNoCopy(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen,
+                                const char *buf, size_t len, redisReleaseFn *release, void *releasePrivdata);
+
+/* Like redisAsyncCommand with a template, see redisCommandTemplateCreate.
+ * Regular commands only, same as redisAsyncCommandArgvNoCopy. */
+int redisvAsyncCommandTemplate(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisCommandTemplate *t, va_list ap);
+int redisAsyncCommandTemplate(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const redisCommandTemplate *t, ...);
+
 #ifdef __cplusplus
 }
 #endif
@@ -31,17 +31,19 @@
 
 #include "fmacros.h"
 #include <string.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
 #include <ctype.h>
+#include <sys/uio.h>
 
 #include "hiredis.h"
 #include "net.h"
 #include "sds.h"
 
-static redisReply *createReplyObject(int type);
+static redisReply *createReplyObject(redisReplyPool *pool, int type);
 static void *createStringObject(const redisReadTask *task, char *str, size_t len);
 static void *createArrayObject(const redisReadTask *task, int elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
@@ -57,13 +59,90 @@ static redisReplyObjectFunctions defaultFunctions = {
     freeReplyObject
 };
 
-/* Create a reply object */
-static redisReply *createReplyObject(int type) {
-    redisReply *r = calloc(1,sizeof(*r));
+/* Block sizes of the pool, for strings and element vectors alike. */
+static const size_t poolSizes[REDIS_POOL_CLASSES] = { 32, 128, 512 };
 
-    if (r == NULL)
-        return NULL;
+static int __redisPoolClass(size_t size) {
+    int c;
+
+    for (c = 0; c < REDIS_POOL_CLASSES; c++)
+        if (size <= poolSizes[c])
+            return c;
+    return -1;
+}
+
+/* Allocate "size" bytes from the pool, falling back to malloc() for blocks
+ * larger than the largest class. */
+static void *__redisPoolAlloc(redisReplyPool *p, size_t size) {
+    int c = __redisPoolClass(size);
+    void *b;
+
+    if (c == -1)
+        return malloc(size);
+
+    b = p->blocks[c];
+    if (b == NULL)
+        return malloc(poolSizes[c]);
+
+    p->blocks[c] = *(void**)b;
+    p->nblocks[c]--;
+    return b;
+}
+
+static void __redisPoolFree(redisReplyPool *p, void *b, size_t size) {
+    int c = __redisPoolClass(size);
+
+    if (c == -1 || p->nblocks[c] >= REDIS_POOL_MAX_FREE) {
+        free(b);
+        return;
+    }
+
+    *(void**)b = p->blocks[c];
+    p->blocks[c] = b;
+    p->nblocks[c]++;
+}
+
+static void __redisPoolRelease(redisReplyPool *p) {
+    redisReply *r;
+    void *b;
+    int c;
+
+    if (--p->refcount > 0)
+        return;
+
+    while ((r = p->replies) != NULL) {
+        p->replies = (redisReply*)r->element;
+        free(r);
+    }
+    for (c = 0; c < REDIS_POOL_CLASSES; c++) {
+        while ((b = p->blocks[c]) != NULL) {
+            p->blocks[c] = *(void**)b;
+            free(b);
+        }
+    }
+    free(p);
+}
+
+/* Create a reply object, taken from the pool when there is one. Pooled
+ * replies hold a reference to it until they are freed. */
+static redisReply *createReplyObject(redisReplyPool *pool, int type) {
+    redisReply *r;
+
+    if (pool != NULL && pool->replies != NULL) {
+        r = pool->replies;
+        pool->replies = (redisReply*)r->element;
+        pool->nreplies--;
+        memset(r,0,sizeof(*r));
+    } else {
+        r = calloc(1,sizeof(*r));
+        if (r == NULL)
+            return NULL;
+    }
 
+    if (pool != NULL) {
+        pool->refcount++;
+        r->pool = pool;
+    }
     r->type = type;
     return r;
 }
@@ -81,16 +160,38 @@ void freeReplyObject(void *reply) {
             for (j = 0; j < r->elements; j++)
                 if (r->element[j] != NULL)
                     freeReplyObject(r->element[j]);
-            free(r->element);
+            if (r->pool != NULL)
+                __redisPoolFree(r->pool,r->element,r->elements*sizeof(redisReply*));
+            else
+                free(r->element);
         }
         break;
     case REDIS_REPLY_ERROR:
     case REDIS_REPLY_STATUS:
     case REDIS_REPLY_STRING:
-        if (r->str != NULL)
+        if (r->chunk != NULL)
+            redisReaderReleaseChunk(r->chunk);
+        else if (r->str != NULL && r->pool != NULL)
+            __redisPoolFree(r->pool,r->str,r->len+1);
+        else if (r->str != NULL)
             free(r->str);
         break;
     }
+
+    /* Hand the node back to its pool, linked through the element field. */
+    if (r->pool != NULL) {
+        redisReplyPool *pool = r->pool;
+
+        if (pool->nreplies < REDIS_POOL_MAX_FREE) {
+            r->element = (redisReply**)pool->replies;
+            pool->replies = r;
+            pool->nreplies++;
+        } else {
+            free(r);
+        }
+        __redisPoolRelease(pool);
+        return;
+    }
     free(r);
 }
 
@@ -98,25 +199,36 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
     redisReply *r, *parent;
     char *buf;
 
-    r = createReplyObject(task->type);
+    r = createReplyObject(task->pool,task->type);
     if (r == NULL)
         return NULL;
 
-    buf = malloc(len+1);
-    if (buf == NULL) {
-        freeReplyObject(r);
-        return NULL;
-    }
-
     assert(task->type == REDIS_REPLY_ERROR  ||
            task->type == REDIS_REPLY_STATUS ||
            task->type == REDIS_REPLY_STRING);
 
-    /* Copy string value */
-    memcpy(buf,str,len);
-    buf[len] = '\0';
-    r->str = buf;
-    r->len = len;
+    if (task->chunk != NULL) {
+        /* The reader terminated the string in place, keep it there. */
+        redisReaderRetainChunk(task->chunk);
+        r->chunk = task->chunk;
+        r->str = str;
+        r->len = len;
+    } else {
+        if (task->pool != NULL)
+            buf = __redisPoolAlloc(task->pool,len+1);
+        else
+            buf = malloc(len+1);
+        if (buf == NULL) {
+            freeReplyObject(r);
+            return NULL;
+        }
+
+        /* Copy string value */
+        memcpy(buf,str,len);
+        buf[len] = '\0';
+        r->str = buf;
+        r->len = len;
+    }
 
     if (task->parent) {
         parent = task->parent->obj;
@@ -129,11 +241,18 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 static void *createArrayObject(const redisReadTask *task, int elements) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_ARRAY);
+    r = createReplyObject(task->pool,REDIS_REPLY_ARRAY);
     if (r == NULL)
         return NULL;
 
-    if (elements > 0) {
+    if (elements > 0 && task->pool != NULL) {
+        r->element = __redisPoolAlloc(task->pool,elements*sizeof(redisReply*));
+        if (r->element == NULL) {
+            freeReplyObject(r);
+            return NULL;
+        }
+        memset(r->element,0,elements*sizeof(redisReply*));
+    } else if (elements > 0) {
         r->element = calloc(elements,sizeof(redisReply*));
         if (r->element == NULL) {
             freeReplyObject(r);
@@ -154,7 +273,7 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
 static void *createIntegerObject(const redisReadTask *task, long long value) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_INTEGER);
+    r = createReplyObject(task->pool,REDIS_REPLY_INTEGER);
     if (r == NULL)
         return NULL;
 
@@ -171,7 +290,7 @@ static void *createIntegerObject(const redisReadTask *task, long long value) {
 static void *createNilObject(const redisReadTask *task) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_NIL);
+    r = createReplyObject(task->pool,REDIS_REPLY_NIL);
     if (r == NULL)
         return NULL;
 
@@ -183,17 +302,31 @@ static void *createNilObject(const redisReadTask *task) {
     return r;
 }
 
+/* Whether the object of the current task gets built. Nothing is built for
+ * a discarded reply, except an error at its top. */
+static int __redisReaderBuilds(redisReader *r, int type) {
+    if (r->fn == NULL)
+        return 0;
+    return !r->discarding || (type == REDIS_REPLY_ERROR && r->ridx == 0);
+}
+
+/* Free the reply being built, unless it is only a placeholder. */
+static void __redisReaderFreeReply(redisReader *r) {
+    if (r->reply != NULL && r->fn && r->fn->freeObject &&
+        (!r->discarding || r->rstack[0].type == REDIS_REPLY_ERROR))
+        r->fn->freeObject(r->reply);
+    r->reply = NULL;
+}
+
 static void __redisReaderSetError(redisReader *r, int type, const char *str) {
     size_t len;
 
-    if (r->reply != NULL && r->fn && r->fn->freeObject) {
-        r->fn->freeObject(r->reply);
-        r->reply = NULL;
-    }
+    __redisReaderFreeReply(r);
 
     /* Clear input buffer on errors. */
-    if (r->buf != NULL) {
-        sdsfree(r->buf);
+    if (r->chunk != NULL) {
+        redisReaderReleaseChunk(r->chunk);
+        r->chunk = NULL;
         r->buf = NULL;
         r->pos = r->len = 0;
     }
@@ -267,7 +400,7 @@ static char *seekNewline(char *s, size_t len) {
      * might not have a trailing NULL character. */
     while (pos < _len) {
         while(pos < _len && s[pos] != '\r') pos++;
-        if (s[pos] != '\r') {
+        if (pos == _len) {
             /* Not found. */
             return NULL;
         } else {
@@ -360,13 +493,13 @@ static int processLineItem(redisReader *r) {
 
     if ((p = readLine(r,&len)) != NULL) {
         if (cur->type == REDIS_REPLY_INTEGER) {
-            if (r->fn && r->fn->createInteger)
+            if (__redisReaderBuilds(r,cur->type) && r->fn->createInteger)
                 obj = r->fn->createInteger(cur,readLongLong(p));
             else
                 obj = (void*)REDIS_REPLY_INTEGER;
         } else {
             /* Type will be error or status. */
-            if (r->fn && r->fn->createString)
+            if (__redisReaderBuilds(r,cur->type) && r->fn->createString)
                 obj = r->fn->createString(cur,p,len);
             else
                 obj = (void*)(size_t)(cur->type);
@@ -403,7 +536,7 @@ static int processBulkItem(redisReader *r) {
 
         if (len < 0) {
             /* The nil object can always be created. */
-            if (r->fn && r->fn->createNil)
+            if (__redisReaderBuilds(r,cur->type) && r->fn->createNil)
                 obj = r->fn->createNil(cur);
             else
                 obj = (void*)REDIS_REPLY_NIL;
@@ -412,9 +545,16 @@ static int processBulkItem(redisReader *r) {
             /* Only continue when the buffer contains the entire bulk item. */
             bytelen += len+2; /* include \r\n */
             if (r->pos+bytelen <= r->len) {
-                if (r->fn && r->fn->createString)
+                if (__redisReaderBuilds(r,cur->type) && r->fn->createString) {
+                    if (r->zerocopy != 0 && (size_t)len >= r->zerocopy) {
+                        /* Terminate in place over the trailing \r, which
+                         * is never looked at again. */
+                        s[2+len] = '\0';
+                        cur->chunk = r->chunk;
+                    }
                     obj = r->fn->createString(cur,s+2,len);
-                else
+                    cur->chunk = NULL;
+                } else
                     obj = (void*)REDIS_REPLY_STRING;
                 success = 1;
             }
@@ -458,7 +598,7 @@ static int processMultiBulkItem(redisReader *r) {
         root = (r->ridx == 0);
 
         if (elements == -1) {
-            if (r->fn && r->fn->createNil)
+            if (__redisReaderBuilds(r,cur->type) && r->fn->createNil)
                 obj = r->fn->createNil(cur);
             else
                 obj = (void*)REDIS_REPLY_NIL;
@@ -470,7 +610,7 @@ static int processMultiBulkItem(redisReader *r) {
 
             moveToNextTask(r);
         } else {
-            if (r->fn && r->fn->createArray)
+            if (__redisReaderBuilds(r,cur->type) && r->fn->createArray)
                 obj = r->fn->createArray(cur,elements);
             else
                 obj = (void*)REDIS_REPLY_ARRAY;
@@ -491,6 +631,7 @@ static int processMultiBulkItem(redisReader *r) {
                 r->rstack[r->ridx].obj = NULL;
                 r->rstack[r->ridx].parent = cur;
                 r->rstack[r->ridx].privdata = r->privdata;
+                r->rstack[r->ridx].pool = r->pool;
             } else {
                 moveToNextTask(r);
             }
@@ -563,27 +704,127 @@ redisReader *redisReaderCreate(void) {
     r->err = 0;
     r->errstr[0] = '\0';
     r->fn = &defaultFunctions;
-    r->buf = sdsempty();
     r->maxbuf = REDIS_READER_MAX_BUF;
-    if (r->buf == NULL) {
-        free(r);
-        return NULL;
-    }
-
     r->ridx = -1;
     return r;
 }
 
 void redisReaderFree(redisReader *r) {
-    if (r->reply != NULL && r->fn && r->fn->freeObject)
-        r->fn->freeObject(r->reply);
-    if (r->buf != NULL)
-        sdsfree(r->buf);
+    __redisReaderFreeReply(r);
+    if (r->chunk != NULL)
+        redisReaderReleaseChunk(r->chunk);
+    if (r->pool != NULL)
+        __redisPoolRelease(r->pool);
     free(r);
 }
 
+void redisReaderDiscard(redisReader *r, unsigned long n) {
+    r->discard = n;
+}
+
+int redisReaderSetPooling(redisReader *r, int enable) {
+    if (enable && r->pool == NULL) {
+        r->pool = calloc(1,sizeof(*r->pool));
+        if (r->pool == NULL)
+            return REDIS_ERR;
+        r->pool->refcount = 1;
+    } else if (!enable && r->pool != NULL) {
+        /* Replies still out keep the pool alive until they are freed. */
+        __redisPoolRelease(r->pool);
+        r->pool = NULL;
+    }
+    return REDIS_OK;
+}
+
+void redisReaderSetZeroCopy(redisReader *r, size_t minlen) {
+    r->zerocopy = minlen;
+}
+
+void redisReaderRetainChunk(redisReaderChunk *ch) {
+    ch->refcount++;
+}
+
+void redisReaderReleaseChunk(redisReaderChunk *ch) {
+    if (--ch->refcount == 0)
+        free(ch);
+}
+
+static redisReaderChunk *__redisReaderChunkCreate(size_t size) {
+    redisReaderChunk *ch;
+
+    ch = malloc(offsetof(redisReaderChunk,data)+size);
+    if (ch == NULL)
+        return NULL;
+
+    ch->refcount = 1;
+    ch->size = size;
+    return ch;
+}
+
+/* Return room for at least "len" more bytes after the buffered input, or
+ * NULL when out of memory. The chunk is only moved or resized while no reply
+ * points into it; otherwise the unconsumed input is carried over to a new
+ * chunk and the old one lives on until its last reply is freed.
+ *
+ * Consumed input is only dropped here, when room is needed, and unconsumed
+ * bytes are never moved more than once per byte that frees up or arrives:
+ * they slide down only over a consumed prefix at least as large, and a new
+ * chunk always leaves as much free space as it copies. */
+static char *__redisReaderReserve(redisReader *r, size_t len) {
+    redisReaderChunk *ch = r->chunk, *newch;
+    size_t unread = r->len-r->pos, size;
+
+    /* Destroy internal buffer when it is empty and would keep more than
+     * maxbuf bytes unused. */
+    if (ch != NULL && unread == 0 && r->maxbuf != 0 && ch->size > len+r->maxbuf) {
+        redisReaderReleaseChunk(ch);
+        r->chunk = ch = NULL;
+        r->buf = NULL;
+        r->pos = r->len = 0;
+    }
+
+    if (ch != NULL && ch->size-r->len >= len)
+        return ch->data+r->len;
+
+    if (ch != NULL && ch->refcount == 1 && r->pos >= unread && r->pos > 0) {
+        /* Nothing else looks at consumed input, move it out of the way. */
+        memmove(ch->data,ch->data+r->pos,unread);
+        r->pos = 0;
+        r->len = unread;
+        if (ch->size-r->len >= len)
+            return ch->data+r->len;
+    }
+
+    if (ch != NULL && ch->refcount == 1 && r->pos == 0) {
+        size = ch->size*2;
+        if (size < r->len+len)
+            size = r->len+len;
+        newch = realloc(ch,offsetof(redisReaderChunk,data)+size);
+        if (newch == NULL)
+            return NULL;
+        newch->size = size;
+    } else {
+        size = unread*2+len;
+        if (size < REDIS_READER_CHUNK_SIZE)
+            size = REDIS_READER_CHUNK_SIZE;
+        newch = __redisReaderChunkCreate(size);
+        if (newch == NULL)
+            return NULL;
+        if (ch != NULL) {
+            memcpy(newch->data,ch->data+r->pos,unread);
+            redisReaderReleaseChunk(ch);
+        }
+        r->pos = 0;
+        r->len = unread;
+    }
+
+    r->chunk = newch;
+    r->buf = newch->data;
+    return r->buf+r->len;
+}
+
 int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
-    sds newbuf;
+    char *dst;
 
     /* Return early when this reader is in an erroneous state. */
     if (r->err)
@@ -591,24 +832,14 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
 
     /* Copy the provided buffer. */
     if (buf != NULL && len >= 1) {
-        /* Destroy internal buffer when it is empty and is quite large. */
-        if (r->len == 0 && r->maxbuf != 0 && sdsavail(r->buf) > r->maxbuf) {
-            sdsfree(r->buf);
-            r->buf = sdsempty();
-            r->pos = 0;
-
-            /* r->buf should not be NULL since we just free'd a larger one. */
-            assert(r->buf != NULL);
-        }
-
-        newbuf = sdscatlen(r->buf,buf,len);
-        if (newbuf == NULL) {
+        dst = __redisReaderReserve(r,len);
+        if (dst == NULL) {
             __redisReaderSetErrorOOM(r);
             return REDIS_ERR;
         }
 
-        r->buf = newbuf;
-        r->len = sdslen(r->buf);
+        memcpy(dst,buf,len);
+        r->len += len;
     }
 
     return REDIS_OK;
@@ -623,45 +854,59 @@ int redisReaderGetReply(redisReader *r, void **reply) {
     if (r->err)
         return REDIS_ERR;
 
-    /* When the buffer is empty, there will never be a reply. */
-    if (r->len == 0)
-        return REDIS_OK;
+    while (1) {
+        /* When the buffer is empty, there will never be a reply. */
+        if (r->len == r->pos)
+            return REDIS_OK;
 
-    /* Set first item to process when the stack is empty. */
-    if (r->ridx == -1) {
-        r->rstack[0].type = -1;
-        r->rstack[0].elements = -1;
-        r->rstack[0].idx = -1;
-        r->rstack[0].obj = NULL;
-        r->rstack[0].parent = NULL;
-        r->rstack[0].privdata = r->privdata;
-        r->ridx = 0;
-    }
+        /* Set first item to process when the stack is empty. */
+        if (r->ridx == -1) {
+            r->rstack[0].type = -1;
+            r->rstack[0].elements = -1;
+            r->rstack[0].idx = -1;
+            r->rstack[0].obj = NULL;
+            r->rstack[0].parent = NULL;
+            r->rstack[0].privdata = r->privdata;
+            r->rstack[0].pool = r->pool;
+            r->ridx = 0;
+            r->discarding = r->discard > 0;
+            if (r->discarding)
+                r->discard--;
+        }
 
-    /* Process items in reply. */
-    while (r->ridx >= 0)
-        if (processItem(r) != REDIS_OK)
-            break;
+        /* Process items in reply. */
+        while (r->ridx >= 0)
+            if (processItem(r) != REDIS_OK)
+                break;
 
-    /* Return ASAP when an error occurred. */
-    if (r->err)
-        return REDIS_ERR;
+        /* Return ASAP when an error occurred. */
+        if (r->err)
+            return REDIS_ERR;
 
-    /* Discard part of the buffer when we've consumed at least 1k, to avoid
-     * doing unnecessary calls to memmove() in sds.c. */
-    if (r->pos >= 1024) {
-        r->buf = sdsrange(r->buf,r->pos,-1);
-        r->pos = 0;
-        r->len = sdslen(r->buf);
-    }
+        /* Rewind for free once everything was consumed. Partial input stays
+         * where it is, __redisReaderReserve() makes room only when it must. */
+        if (r->pos == r->len && r->chunk->refcount == 1)
+            r->pos = r->len = 0;
+
+        if (r->ridx != -1)
+            return REDIS_OK;
 
-    /* Emit a reply when there is one. */
-    if (r->ridx == -1) {
+        /* A discarded reply is only counted, go on with the next one. */
+        if (r->discarding) {
+            r->discarding = 0;
+            if (r->rstack[0].type != REDIS_REPLY_ERROR) {
+                r->reply = NULL;
+                r->discarded++;
+                continue;
+            }
+        }
+
+        /* Emit the reply. */
         if (reply != NULL)
             *reply = r->reply;
         r->reply = NULL;
+        return REDIS_OK;
     }
-    return REDIS_OK;
 }
 
 /* Calculate the number of bytes needed to represent an integer as string. */
@@ -997,12 +1242,78 @@ static redisContext *redisContextInit(void) {
     c->errstr[0] = '\0';
     c->obuf = sdsempty();
     c->reader = redisReaderCreate();
+    c->rsize = REDIS_READ_MIN;
+    c->rbudget = REDIS_READ_BUDGET;
     return c;
 }
 
+/* Hand a borrowed segment back to its owner. */
+static void __redisReleaseChunk(redisOutputChunk *ch) {
+    if (ch->buf != NULL && ch->release != NULL)
+        ch->release((void*)ch->buf,ch->privdata);
+}
+
+/* Make sure "n" more segments fit in the output ring. The ring only grows,
+ * so a steady stream of commands stops allocating once it is large enough. */
+static int __redisQueueReserve(redisContext *c, size_t n) {
+    redisOutputChunk *q;
+    size_t cap, j;
+
+    if (c->ocap-c->ocount >= n)
+        return REDIS_OK;
+
+    cap = c->ocap ? c->ocap*2 : 16;
+    while (cap-c->ocount < n)
+        cap *= 2;
+    q = malloc(sizeof(*q)*cap);
+    if (q == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    for (j = 0; j < c->ocount; j++)
+        q[j] = c->oqueue[(c->ofirst+j) % c->ocap];
+    free(c->oqueue);
+    c->oqueue = q;
+    c->ocap = cap;
+    c->ofirst = 0;
+    return REDIS_OK;
+}
+
+/* Append a segment to the ring, which must have room for it. */
+static redisOutputChunk *__redisQueuePush(redisContext *c) {
+    assert(c->ocount < c->ocap);
+    return &c->oqueue[(c->ofirst+c->ocount++) % c->ocap];
+}
+
+/* Account for "len" bytes just appended to obuf: they extend the last
+ * segment when it is a range of obuf, or open a new range. */
+static void __redisQueueObuf(redisContext *c, size_t len) {
+    redisOutputChunk *ch = NULL;
+
+    if (c->ocount > 0)
+        ch = &c->oqueue[(c->ofirst+c->ocount-1) % c->ocap];
+    if (ch == NULL || ch->buf != NULL) {
+        ch = __redisQueuePush(c);
+        ch->buf = NULL;
+        ch->len = 0;
+        ch->pos = 0;
+        ch->release = NULL;
+        ch->privdata = NULL;
+    }
+    ch->len += len;
+    c->opending += len;
+}
+
 void redisFree(redisContext *c) {
     if (c->fd > 0)
         close(c->fd);
+    while (c->ocount > 0) {
+        __redisReleaseChunk(&c->oqueue[c->ofirst]);
+        c->ofirst = (c->ofirst+1) % c->ocap;
+        c->ocount--;
+    }
+    free(c->oqueue);
     if (c->obuf != NULL)
         sdsfree(c->obuf);
     if (c->reader != NULL)
@@ -1099,36 +1410,85 @@ int redisEnableKeepAlive(redisContext *c) {
     return REDIS_OK;
 }
 
+/* Index of the power-of-two bucket of REDIS_READ_BUCKETS that counts "v".
+ * Bucket i counts values in [2^(i-1), 2^i), the last one everything above. */
+static int __redisReadBucket(unsigned long long v) {
+    int i = 0;
+    while (v != 0 && i < REDIS_READ_BUCKETS-1) {
+        v >>= 1;
+        i++;
+    }
+    return i;
+}
+
 /* Use this function to handle a read event on the descriptor. It will try
  * and read some bytes from the socket and feed them to the reply parser.
  *
+ * Data goes straight into the reader buffer. A non-blocking socket is
+ * drained until a read comes back short or c->rbudget bytes were read, so a
+ * busy subscription costs one wakeup for many reads. The read size doubles
+ * while reads fill it and halves when they use less than a quarter of it.
+ *
  * After this function is called, you may use redisContextReadReply to
  * see if there is a reply available. */
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
+    redisReader *r = c->reader;
+    size_t total = 0;
+    char *buf;
     int nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
+    if (r->err) {
+        __redisSetError(c,r->err,r->errstr);
+        return REDIS_ERR;
+    }
 
-    nread = read(c->fd,buf,sizeof(buf));
-    if (nread == -1) {
-        if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
-            /* Try again later */
-        } else {
-            __redisSetError(c,REDIS_ERR_IO,NULL);
+    do {
+        buf = __redisReaderReserve(r,c->rsize);
+        if (buf == NULL) {
+            __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
             return REDIS_ERR;
         }
-    } else if (nread == 0) {
-        __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
-        return REDIS_ERR;
-    } else {
-        if (redisReaderFeed(c->reader,buf,nread) != REDIS_OK) {
-            __redisSetError(c,c->reader->err,c->reader->errstr);
+
+        nread = read(c->fd,buf,c->rsize);
+        if (nread == -1) {
+            if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
+                /* Try again later */
+                break;
+            } else {
+                __redisSetError(c,REDIS_ERR_IO,NULL);
+                return REDIS_ERR;
+            }
+        } else if (nread == 0) {
+            /* Hand over what was read first, EOF shows up again next time. */
+            if (total > 0)
+                break;
+            __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
             return REDIS_ERR;
         }
-    }
+
+        r->len += nread;
+        total += nread;
+        c->rstats.calls++;
+        c->rstats.bytes += nread;
+        c->rstats.hist[__redisReadBucket(nread)]++;
+
+        if ((size_t)nread == c->rsize) {
+            if (c->rsize < REDIS_READ_MAX)
+                c->rsize *= 2;
+        } else {
+            if ((size_t)nread < c->rsize/4 && c->rsize > REDIS_READ_MIN)
+                c->rsize /= 2;
+
+            /* A short read means the socket is empty for now. */
+            break;
+        }
+    } while (!(c->flags & REDIS_BLOCK) && total < c->rbudget);
+
+    if (total > 0)
+        c->rstats.events++;
     return REDIS_OK;
 }
 
@@ -1142,14 +1502,34 @@ int redisBufferRead(redisContext *c) {
  * c->errstr to hold the appropriate error string.
  */
 int redisBufferWrite(redisContext *c, int *done) {
-    int nwritten;
+    struct iovec iov[REDIS_WRITE_IOV_MAX];
+    redisOutputChunk *ch;
+    size_t off = c->opos, left, j;
+    int nwritten, iovcnt = 0;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    if (sdslen(c->obuf) > 0) {
-        nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
+    /* Gather the segments in order, ranges of obuf are located by walking
+     * them from opos. */
+    for (j = 0; j < c->ocount && iovcnt < REDIS_WRITE_IOV_MAX; j++) {
+        ch = &c->oqueue[(c->ofirst+j) % c->ocap];
+        if (ch->buf != NULL) {
+            iov[iovcnt].iov_base = (char*)ch->buf+ch->pos;
+        } else {
+            iov[iovcnt].iov_base = c->obuf+off+ch->pos;
+            off += ch->len;
+        }
+        iov[iovcnt].iov_len = ch->len-ch->pos;
+        iovcnt++;
+    }
+
+    if (iovcnt > 0) {
+        if (iovcnt == 1)
+            nwritten = write(c->fd,iov[0].iov_base,iov[0].iov_len);
+        else
+            nwritten = writev(c->fd,iov,iovcnt);
         if (nwritten == -1) {
             if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
                 /* Try again later */
@@ -1158,15 +1538,46 @@ int redisBufferWrite(redisContext *c, int *done) {
                 return REDIS_ERR;
             }
         } else if (nwritten > 0) {
-            if (nwritten == (signed)sdslen(c->obuf)) {
-                sdsfree(c->obuf);
-                c->obuf = sdsempty();
-            } else {
-                c->obuf = sdsrange(c->obuf,nwritten,-1);
+            c->opending -= nwritten;
+            c->ostats.writes++;
+            c->ostats.bytes += nwritten;
+
+            /* Drop the segments that went out completely, a partial one
+             * only moves its offset. */
+            left = nwritten;
+            while (left > 0) {
+                ch = &c->oqueue[c->ofirst];
+                if (left < ch->len-ch->pos) {
+                    ch->pos += left;
+                    break;
+                }
+                left -= ch->len-ch->pos;
+                if (ch->buf == NULL)
+                    c->opos += ch->len;
+                __redisReleaseChunk(ch);
+                c->ofirst = (c->ofirst+1) % c->ocap;
+                c->ocount--;
+                c->ostats.segments++;
+            }
+
+            if (c->opos == sdslen(c->obuf)) {
+                /* Everything in obuf went out, start over at its beginning. */
+                if (sdsavail(c->obuf) > REDIS_WRITE_MAX_BUF) {
+                    sdsfree(c->obuf);
+                    c->obuf = sdsempty();
+                } else {
+                    sdsclear(c->obuf);
+                }
+                c->opos = 0;
+            } else if (c->opos >= REDIS_WRITE_MAX_BUF && c->opos >= sdslen(c->obuf)-c->opos) {
+                /* Under backpressure obuf may never drain, so drop the
+                 * written part once it outweighs the rest. */
+                c->obuf = sdsrange(c->obuf,c->opos,-1);
+                c->opos = 0;
             }
         }
     }
-    if (done != NULL) *done = (sdslen(c->obuf) == 0);
+    if (done != NULL) *done = (c->ocount == 0);
     return REDIS_OK;
 }
 
@@ -1220,6 +1631,9 @@ int redisGetReply(redisContext *c, void **reply) {
 int __redisAppendCommand(redisContext *c, char *cmd, size_t len) {
     sds newbuf;
 
+    if (__redisQueueReserve(c,1) != REDIS_OK)
+        return REDIS_ERR;
+
     newbuf = sdscatlen(c->obuf,cmd,len);
     if (newbuf == NULL) {
         __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
@@ -1227,6 +1641,7 @@ int __redisAppendCommand(redisContext *c, char *cmd, size_t len) {
     }
 
     c->obuf = newbuf;
+    __redisQueueObuf(c,len);
     return REDIS_OK;
 }
 
@@ -1278,6 +1693,405 @@ int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const s
     return REDIS_OK;
 }
 
+/* Queue a borrowed buffer after everything that was appended so far. Nothing
+ * is queued when this fails. */
+int __redisAppendBorrowed(redisContext *c, const char *buf, size_t len, redisReleaseFn *release, void *privdata) {
+    redisOutputChunk *ch;
+
+    if (__redisQueueReserve(c,1) != REDIS_OK)
+        return REDIS_ERR;
+
+    ch = __redisQueuePush(c);
+    ch->buf = buf;
+    ch->len = len;
+    ch->pos = 0;
+    ch->release = release;
+    ch->privdata = privdata;
+    c->opending += len;
+    return REDIS_OK;
+}
+
+/* Conversions of a command template. */
+#define REDIS_CONV_STR 's'
+#define REDIS_CONV_BIN 'b'
+#define REDIS_CONV_INT 'd'
+#define REDIS_CONV_UINT 'u'
+#define REDIS_CONV_LONG 'l'
+#define REDIS_CONV_ULONG 'm'
+#define REDIS_CONV_LLONG 'q'
+#define REDIS_CONV_ULLONG 'Q'
+#define REDIS_CONV_SIZE 'z'
+
+/* Room for the digits of any converted number, sign included. */
+#define REDIS_TEMPLATE_DIGITS 24
+
+redisCommandTemplate *redisCommandTemplateCreate(const char *format) {
+    redisCommandTemplate *t;
+    redisTemplatePart *part = NULL; /* last part of the current argument */
+    size_t flen = strlen(format), tlen = 0;
+    const char *c = format;
+    int nparts = 0;
+    char conv;
+
+    t = calloc(1,sizeof(*t));
+    if (t == NULL)
+        return NULL;
+
+    /* Every byte of the format starts at most one part or argument. */
+    t->parts = malloc(sizeof(redisTemplatePart)*(flen+1));
+    t->argparts = malloc(sizeof(int)*(flen+1));
+    t->text = malloc(flen+1);
+    if (t->parts == NULL || t->argparts == NULL || t->text == NULL)
+        goto err;
+
+    while (*c != '\0') {
+        if (*c == ' ') {
+            /* Close the current argument, like redisvFormatCommand. */
+            if (part != NULL) {
+                t->argc++;
+                part = NULL;
+            }
+            c++;
+            continue;
+        }
+
+        if (part == NULL)
+            t->argparts[t->argc] = 0;
+
+        if (*c != '%' || c[1] == '\0' || c[1] == '%') {
+            if (*c == '%' && c[1] == '%')
+                c++;
+
+            /* Literal bytes in a row share one part. */
+            if (part == NULL || part->conv != 0) {
+                part = &t->parts[nparts++];
+                part->conv = 0;
+                part->str = t->text+tlen;
+                part->len = 0;
+                t->argparts[t->argc]++;
+            }
+            t->text[tlen++] = *c++;
+            part->len++;
+            continue;
+        }
+
+        c++;
+        if (c[0] == 's') {
+            conv = REDIS_CONV_STR;
+        } else if (c[0] == 'b') {
+            conv = REDIS_CONV_BIN;
+        } else if (c[0] == 'd' || c[0] == 'i') {
+            conv = REDIS_CONV_INT;
+        } else if (c[0] == 'u') {
+            conv = REDIS_CONV_UINT;
+        } else if (c[0] == 'z' && c[1] == 'u') {
+            conv = REDIS_CONV_SIZE;
+            c++;
+        } else if (c[0] == 'l' && (c[1] == 'd' || c[1] == 'i')) {
+            conv = REDIS_CONV_LONG;
+            c++;
+        } else if (c[0] == 'l' && c[1] == 'u') {
+            conv = REDIS_CONV_ULONG;
+            c++;
+        } else if (c[0] == 'l' && c[1] == 'l' && (c[2] == 'd' || c[2] == 'i')) {
+            conv = REDIS_CONV_LLONG;
+            c += 2;
+        } else if (c[0] == 'l' && c[1] == 'l' && c[2] == 'u') {
+            conv = REDIS_CONV_ULLONG;
+            c += 2;
+        } else {
+            goto err;
+        }
+        c++;
+
+        if (t->nparams == REDIS_TEMPLATE_MAX_PARAMS)
+            goto err;
+        t->nparams++;
+
+        part = &t->parts[nparts++];
+        part->conv = conv;
+        part->str = NULL;
+        part->len = 0;
+        t->argparts[t->argc]++;
+    }
+
+    if (part != NULL)
+        t->argc++;
+    if (t->argc == 0)
+        goto err;
+    return t;
+
+err:
+    redisCommandTemplateFree(t);
+    return NULL;
+}
+
+void redisCommandTemplateFree(redisCommandTemplate *t) {
+    if (t == NULL)
+        return;
+    free(t->parts);
+    free(t->argparts);
+    free(t->text);
+    free(t);
+}
+
+/* Write "v" in decimal to "dst", returning the number of bytes written. */
+static size_t __redisFormatUnsigned(char *dst, unsigned long long v) {
+    char tmp[20];
+    size_t n = 0, j;
+
+    do {
+        tmp[n++] = '0'+(v%10);
+        v /= 10;
+    } while (v);
+
+    for (j = 0; j < n; j++)
+        dst[j] = tmp[n-1-j];
+    return n;
+}
+
+static size_t __redisFormatSigned(char *dst, long long v) {
+    if (v < 0) {
+        dst[0] = '-';
+        return 1+__redisFormatUnsigned(dst+1,-(unsigned long long)v);
+    }
+    return __redisFormatUnsigned(dst,v);
+}
+
+/* Length of argument "i" of a template, given the parameters. "k" and "n"
+ * are the indexes of its first part and of its first parameter. */
+static size_t __redisTemplateArgLen(const redisCommandTemplate *t, int i, int k, int n, const size_t *plen) {
+    size_t len = 0;
+    int j;
+
+    for (j = 0; j < t->argparts[i]; j++, k++)
+        len += t->parts[k].conv ? plen[n++] : t->parts[k].len;
+    return len;
+}
+
+/* Collect the parameters of a template and return the exact length of the
+ * command. Numbers are converted into "digits". */
+static size_t __redisTemplateParams(const redisCommandTemplate *t, va_list ap, const char **pstr, size_t *plen,
+                                    char (*digits)[REDIS_TEMPLATE_DIGITS]) {
+    const redisTemplatePart *part;
+    size_t totlen;
+    int i, j, k, n;
+
+    for (k = 0, n = 0; n < t->nparams; k++) {
+        part = &t->parts[k];
+        if (part->conv == 0)
+            continue;
+
+        pstr[n] = digits[n];
+        switch (part->conv) {
+        case REDIS_CONV_STR:
+            pstr[n] = va_arg(ap,const char*);
+            plen[n] = strlen(pstr[n]);
+            break;
+        case REDIS_CONV_BIN:
+            pstr[n] = va_arg(ap,const char*);
+            plen[n] = va_arg(ap,size_t);
+            break;
+        case REDIS_CONV_INT:
+            plen[n] = __redisFormatSigned(digits[n],va_arg(ap,int));
+            break;
+        case REDIS_CONV_UINT:
+            plen[n] = __redisFormatUnsigned(digits[n],va_arg(ap,unsigned int));
+            break;
+        case REDIS_CONV_LONG:
+            plen[n] = __redisFormatSigned(digits[n],va_arg(ap,long));
+            break;
+        case REDIS_CONV_ULONG:
+            plen[n] = __redisFormatUnsigned(digits[n],va_arg(ap,unsigned long));
+            break;
+        case REDIS_CONV_LLONG:
+            plen[n] = __redisFormatSigned(digits[n],va_arg(ap,long long));
+            break;
+        case REDIS_CONV_ULLONG:
+            plen[n] = __redisFormatUnsigned(digits[n],va_arg(ap,unsigned long long));
+            break;
+        case REDIS_CONV_SIZE:
+            plen[n] = __redisFormatUnsigned(digits[n],va_arg(ap,size_t));
+            break;
+        }
+        n++;
+    }
+
+    totlen = 1+intlen(t->argc)+2;
+    for (i = 0, k = 0, n = 0; i < t->argc; i++) {
+        totlen += bulklen(__redisTemplateArgLen(t,i,k,n,plen));
+        for (j = 0; j < t->argparts[i]; j++, k++)
+            if (t->parts[k].conv) n++;
+    }
+    return totlen;
+}
+
+/* Write the command of a template in one pass, returning its end. */
+static char *__redisTemplateWrite(const redisCommandTemplate *t, const char **pstr, const size_t *plen, char *p) {
+    const redisTemplatePart *part;
+    int i, j, k, n;
+
+    *p++ = '*';
+    p += __redisFormatUnsigned(p,t->argc);
+    *p++ = '\r';
+    *p++ = '\n';
+    for (i = 0, k = 0, n = 0; i < t->argc; i++) {
+        *p++ = '$';
+        p += __redisFormatUnsigned(p,__redisTemplateArgLen(t,i,k,n,plen));
+        *p++ = '\r';
+        *p++ = '\n';
+
+        for (j = 0; j < t->argparts[i]; j++, k++) {
+            part = &t->parts[k];
+            if (part->conv == 0) {
+                memcpy(p,part->str,part->len);
+                p += part->len;
+            } else {
+                if (plen[n] > 0)
+                    memcpy(p,pstr[n],plen[n]);
+                p += plen[n++];
+            }
+        }
+        *p++ = '\r';
+        *p++ = '\n';
+    }
+    return p;
+}
+
+int redisvFormatTemplate(char **target, const redisCommandTemplate *t, va_list ap) {
+    const char *pstr[REDIS_TEMPLATE_MAX_PARAMS];
+    size_t plen[REDIS_TEMPLATE_MAX_PARAMS], totlen;
+    char digits[REDIS_TEMPLATE_MAX_PARAMS][REDIS_TEMPLATE_DIGITS];
+    char *cmd, *end;
+
+    totlen = __redisTemplateParams(t,ap,pstr,plen,digits);
+    cmd = malloc(totlen+1);
+    if (cmd == NULL)
+        return -1;
+
+    end = __redisTemplateWrite(t,pstr,plen,cmd);
+    assert((size_t)(end-cmd) == totlen);
+    *end = '\0';
+
+    *target = cmd;
+    return totlen;
+}
+
+int redisFormatTemplate(char **target, const redisCommandTemplate *t, ...) {
+    va_list ap;
+    int len;
+
+    va_start(ap,t);
+    len = redisvFormatTemplate(target,t,ap);
+    va_end(ap);
+    return len;
+}
+
+int redisvAppendTemplate(redisContext *c, const redisCommandTemplate *t, va_list ap) {
+    const char *pstr[REDIS_TEMPLATE_MAX_PARAMS];
+    size_t plen[REDIS_TEMPLATE_MAX_PARAMS], totlen;
+    char digits[REDIS_TEMPLATE_MAX_PARAMS][REDIS_TEMPLATE_DIGITS];
+    char *start, *end;
+    sds newbuf;
+
+    /* Exact length first, so the buffer grows at most once. */
+    totlen = __redisTemplateParams(t,ap,pstr,plen,digits);
+    if (__redisQueueReserve(c,1) != REDIS_OK)
+        return REDIS_ERR;
+    newbuf = sdsMakeRoomFor(c->obuf,totlen);
+    if (newbuf == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    c->obuf = newbuf;
+
+    /* Then the command, right after what is already buffered. */
+    start = c->obuf+sdslen(c->obuf);
+    end = __redisTemplateWrite(t,pstr,plen,start);
+    assert((size_t)(end-start) == totlen);
+
+    sdsIncrLen(c->obuf,totlen);
+    __redisQueueObuf(c,totlen);
+    return REDIS_OK;
+}
+
+int redisAppendTemplate(redisContext *c, const redisCommandTemplate *t, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap,t);
+    ret = redisvAppendTemplate(c,t,ap);
+    va_end(ap);
+    return ret;
+}
+
+int redisAppendCommandArgvNoCopy(redisContext *c, int argc, const char **argv, const size_t *argvlen,
+                                 const char *buf, size_t len, redisReleaseFn *release, void *privdata) {
+    char *start, *p;
+    size_t arglen, hdrlen;
+    sds newbuf;
+    int j;
+
+    if (argc < 1) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Empty command");
+        return REDIS_ERR;
+    }
+
+    /* Exact header length first. The last argument is declared "len" bytes
+     * longer, and its bulk trailer comes after the payload. */
+    hdrlen = 1+intlen(argc)+2;
+    for (j = 0; j < argc; j++) {
+        arglen = argvlen ? argvlen[j] : strlen(argv[j]);
+        if (j == argc-1)
+            hdrlen += bulklen(arglen+len)-len-2;
+        else
+            hdrlen += bulklen(arglen);
+    }
+
+    /* Header, payload and trailer segments, and room in obuf for the header
+     * and the trailer. Once the header is queued nothing can fail, and once
+     * obuf and the ring have grown nothing is allocated. */
+    if (__redisQueueReserve(c,3) != REDIS_OK)
+        return REDIS_ERR;
+    newbuf = sdsMakeRoomFor(c->obuf,hdrlen+2);
+    if (newbuf == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    c->obuf = newbuf;
+
+    /* The header goes right after what is already buffered. */
+    start = p = c->obuf+sdslen(c->obuf);
+    *p++ = '*';
+    p += __redisFormatUnsigned(p,argc);
+    *p++ = '\r';
+    *p++ = '\n';
+    for (j = 0; j < argc; j++) {
+        arglen = argvlen ? argvlen[j] : strlen(argv[j]);
+        *p++ = '$';
+        p += __redisFormatUnsigned(p,(j == argc-1) ? arglen+len : arglen);
+        *p++ = '\r';
+        *p++ = '\n';
+        memcpy(p,argv[j],arglen);
+        p += arglen;
+        if (j < argc-1) {
+            *p++ = '\r';
+            *p++ = '\n';
+        }
+    }
+    assert((size_t)(p-start) == hdrlen);
+
+    sdsIncrLen(c->obuf,hdrlen);
+    __redisQueueObuf(c,hdrlen);
+
+    __redisAppendBorrowed(c,buf,len,release,privdata);
+
+    /* The buffer is owned by the queue from here on. When the trailer cannot
+     * be appended the context is flagged and releases it on redisFree(). */
+    __redisAppendCommand(c,(char*)"\r\n",2);
+    return REDIS_OK;
+}
+
 /* Helper function for the redisCommand* family of functions.
  *
  * Write a formatted command to the output buffer. If the given context is
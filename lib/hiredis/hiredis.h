@@ -87,6 +87,18 @@
 #define REDIS_REPLY_ERROR 6
 
 #define REDIS_READER_MAX_BUF (1024*16)  /* Default max unused reader buffer. */
+#define REDIS_READER_CHUNK_SIZE (1024*16) /* Default size of a reader buffer. */
+#define REDIS_POOL_CLASSES 3 /* Pooled block sizes: 32, 128 and 512 bytes. */
+#define REDIS_POOL_MAX_FREE 256 /* Max free entries a pool keeps per list. */
+
+#define REDIS_WRITE_IOV_MAX 64 /* Max chunks handed to a single writev(2). */
+#define REDIS_WRITE_MAX_BUF (1024*64) /* Max unused obuf kept once flushed. */
+#define REDIS_TEMPLATE_MAX_PARAMS 16 /* Max conversions in a command template. */
+
+#define REDIS_READ_MIN (1024*16) /* Initial and smallest read(2) size. */
+#define REDIS_READ_MAX (1024*1024) /* Largest read(2) size. */
+#define REDIS_READ_BUDGET (1024*1024*4) /* Default max bytes per redisBufferRead. */
+#define REDIS_READ_BUCKETS 32 /* Power-of-two buckets of bytes per read(2). */
 
 #define REDIS_KEEPALIVE_INTERVAL 15 /* seconds */
 
@@ -94,6 +106,25 @@
 extern "C" {
 #endif
 
+/* Input buffer of a reader. Zero-copy reply strings point into it and hold
+ * a reference, so it outlives the reader for as long as they do. */
+typedef struct redisReaderChunk {
+    int refcount;
+    size_t size; /* Bytes available in data */
+    char data[1];
+} redisReaderChunk;
+
+/* Free lists of reply nodes and of small blocks for strings and element
+ * vectors, owned by a reader. Every node taken out holds a reference, so
+ * pooled replies may outlive their reader. */
+typedef struct redisReplyPool {
+    int refcount;
+    struct redisReply *replies; /* Free nodes, linked through element */
+    size_t nreplies;
+    void *blocks[REDIS_POOL_CLASSES]; /* Linked through their first word */
+    size_t nblocks[REDIS_POOL_CLASSES];
+} redisReplyPool;
+
 /* This is the reply object returned by redisCommand() */
 typedef struct redisReply {
     int type; /* REDIS_REPLY_* */
@@ -102,6 +133,8 @@ typedef struct redisReply {
     char *str; /* Used for both REDIS_REPLY_ERROR and REDIS_REPLY_STRING */
     size_t elements; /* number of elements, for REDIS_REPLY_ARRAY */
     struct redisReply **element; /* elements vector for REDIS_REPLY_ARRAY */
+    redisReaderChunk *chunk; /* Buffer holding str when it was not copied */
+    redisReplyPool *pool; /* Pool the reply goes back to, if any */
 } redisReply;
 
 typedef struct redisReadTask {
@@ -111,6 +144,8 @@ typedef struct redisReadTask {
     void *obj; /* holds user-generated value for a read task */
     struct redisReadTask *parent; /* parent task */
     void *privdata; /* user-settable arbitrary field */
+    redisReaderChunk *chunk; /* set when the string may be kept in place */
+    redisReplyPool *pool; /* set when replies come from the reader's pool */
 } redisReadTask;
 
 typedef struct redisReplyObjectFunctions {
@@ -126,15 +161,22 @@ typedef struct redisReader {
     int err; /* Error flags, 0 when there is no error */
     char errstr[128]; /* String representation of error when applicable */
 
-    char *buf; /* Read buffer */
+    char *buf; /* Read buffer, data of the current chunk */
     size_t pos; /* Buffer cursor */
     size_t len; /* Buffer length */
     size_t maxbuf; /* Max length of unused buffer */
+    redisReaderChunk *chunk; /* Current chunk, NULL until data arrives */
+    size_t zerocopy; /* Min length of bulk strings kept in place, 0 = off */
+    redisReplyPool *pool; /* Reply allocator, NULL unless pooling is on */
 
     redisReadTask rstack[9];
     int ridx; /* Index of current read task */
     void *reply; /* Temporary reply pointer */
 
+    unsigned long discard; /* Replies left to parse without building them */
+    int discarding; /* The reply being parsed is one of them */
+    unsigned long long discarded; /* Replies thrown away so far */
+
     redisReplyObjectFunctions *fn;
     void *privdata;
 } redisReader;
@@ -145,6 +187,24 @@ void redisReaderFree(redisReader *r);
 int redisReaderFeed(redisReader *r, const char *buf, size_t len);
 int redisReaderGetReply(redisReader *r, void **reply);
 
+/* Bulk strings of at least "minlen" bytes are no longer copied: the reply
+ * points into the reader buffer and keeps it alive until it is freed.
+ * Pass 0 to copy every string again, which is the default. */
+void redisReaderSetZeroCopy(redisReader *r, size_t minlen);
+void redisReaderRetainChunk(redisReaderChunk *ch);
+void redisReaderReleaseChunk(redisReaderChunk *ch);
+
+/* Take reply nodes, strings and element vectors of the default reply
+ * functions from free lists owned by the reader instead of malloc(), so
+ * a steady stream of similar replies stops allocating. Off by default. */
+int redisReaderSetPooling(redisReader *r, int enable);
+
+/* Parse the next "n" replies without building them: they only add to
+ * "discarded" and redisReaderGetReply moves on to the reply after them.
+ * An error reply is built and returned as usual, errors nested in a
+ * discarded array are not seen. Replaces any count that was left. */
+void redisReaderDiscard(redisReader *r, unsigned long n);
+
 /* Backwards compatibility, can be removed on big version bump. */
 #define redisReplyReaderCreate redisReaderCreate
 #define redisReplyReaderFree redisReaderFree
@@ -162,6 +222,45 @@ int redisvFormatCommand(char **target, const char *format, va_list ap);
 int redisFormatCommand(char **target, const char *format, ...);
 int redisFormatCommandArgv(char **target, int argc, const char **argv, const size_t *argvlen);
 
+/* A command format parsed once by redisCommandTemplateCreate(). Every
+ * argument is a run of parts, each one literal text or a conversion. */
+typedef struct redisTemplatePart {
+    char conv; /* 0 for literal text, else the kind of conversion */
+    const char *str; /* Literal text */
+    size_t len;
+} redisTemplatePart;
+
+typedef struct redisCommandTemplate {
+    int argc;
+    int nparams; /* Conversions, at most REDIS_TEMPLATE_MAX_PARAMS */
+    int *argparts; /* Number of parts of every argument */
+    redisTemplatePart *parts;
+    char *text; /* Storage of the literal text */
+} redisCommandTemplate;
+
+/* Parse a format like the ones of redisCommand() once, so filling it in does
+ * not parse it again. Supports %s, %b, %d, %i, %u, %ld, %li, %lu, %lld, %lli,
+ * %llu, %zu and %%; returns NULL on other conversions or out of memory. */
+redisCommandTemplate *redisCommandTemplateCreate(const char *format);
+void redisCommandTemplateFree(redisCommandTemplate *t);
+int redisvFormatTemplate(char **target, const redisCommandTemplate *t, va_list ap);
+int redisFormatTemplate(char **target, const redisCommandTemplate *t, ...);
+
+/* Release callback for buffers that are written to the socket without
+ * being copied into the output buffer. */
+typedef void (redisReleaseFn)(void *buf, void *privdata);
+
+/* A segment of the output queue: either a range of obuf, when buf is NULL,
+ * or a borrowed buffer written with writev(2) straight from user memory.
+ * Ranges of obuf follow each other in queue order. */
+typedef struct redisOutputChunk {
+    const char *buf;
+    size_t len;
+    size_t pos; /* Bytes already written */
+    redisReleaseFn *release; /* Called once the chunk is written or dropped */
+    void *privdata;
+} redisOutputChunk;
+
 /* Context for a connection to Redis */
 typedef struct redisContext {
     int err; /* Error flags, 0 when there is no error */
@@ -169,7 +268,26 @@ typedef struct redisContext {
     int fd;
     int flags;
     char *obuf; /* Write buffer */
+    size_t opos; /* Start in obuf of the first range still queued */
+    redisOutputChunk *oqueue; /* Ring of segments not completely written */
+    size_t ocap, ofirst, ocount; /* Its size, first slot and segments in flight */
+    size_t opending; /* Bytes not written yet, every segment together */
+    struct {
+        unsigned long long writes; /* write(2)/writev(2) calls that wrote data */
+        unsigned long long bytes; /* Bytes those calls wrote */
+        unsigned long long segments; /* Segments written completely */
+    } ostats;
     redisReader *reader; /* Protocol reader */
+
+    /* Input side, see redisBufferRead */
+    size_t rsize; /* Bytes asked for by the next read(2) */
+    size_t rbudget; /* Max bytes drained per call on a non-blocking socket */
+    struct {
+        unsigned long long calls; /* read(2) calls that returned data */
+        unsigned long long bytes; /* Bytes those calls returned */
+        unsigned long long events; /* redisBufferRead calls that read data */
+        unsigned long long hist[REDIS_READ_BUCKETS]; /* Bytes per call, log2 */
+    } rstats;
 } redisContext;
 
 redisContext *redisConnect(const char *ip, int port);
@@ -197,6 +315,18 @@ int redisvAppendCommand(redisContext *c, const char *format, va_list ap);
 int redisAppendCommand(redisContext *c, const char *format, ...);
 int redisAppendCommandArgv(redisContext *c, int argc, const char **argv, const size_t *argvlen);
 
+/* Fill in a template with arguments as for its format, and write the
+ * command in one pass straight into the output buffer. */
+int redisvAppendTemplate(redisContext *c, const redisCommandTemplate *t, va_list ap);
+int redisAppendTemplate(redisContext *c, const redisCommandTemplate *t, ...);
+
+/* Like redisAppendCommandArgv, but "buf" is appended to the last argument
+ * without being copied. The buffer is written straight from user memory and
+ * "release" is called once it went out or the context dropped it. When
+ * REDIS_ERR is returned, ownership of "buf" stays with the caller. */
+int redisAppendCommandArgvNoCopy(redisContext *c, int argc, const char **argv, const size_t *argvlen,
+                                 const char *buf, size_t len, redisReleaseFn *release, void *privdata);
+
 /* Issue a command to Redis. In a blocking context, it is identical to calling
  * redisAppendCommand, followed by redisGetReply. The function will return
  * NULL if there was an error in performing the request, otherwise it will
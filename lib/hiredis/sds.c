@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <assert.h>
 #include "sds.h"
 
 #ifdef SDS_ABORT_ON_OOM
@@ -85,7 +86,7 @@ void sdsupdatelen(sds s) {
     sh->len = reallen;
 }
 
-static sds sdsMakeRoomFor(sds s, size_t addlen) {
+sds sdsMakeRoomFor(sds s, size_t addlen) {
     struct sdshdr *sh, *newsh;
     size_t free = sdsavail(s);
     size_t len, newlen;
@@ -105,6 +106,26 @@ static sds sdsMakeRoomFor(sds s, size_t addlen) {
     return newsh->buf;
 }
 
+/* Account for "incr" bytes written right after the current content, in
+ * space obtained with sdsMakeRoomFor(), and terminate the string again. */
+void sdsIncrLen(sds s, size_t incr) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    assert(sh->free >= (int)incr);
+    sh->len += incr;
+    sh->free -= incr;
+    s[sh->len] = '\0';
+}
+
+/* Make the string empty, keeping its allocation for reuse. */
+void sdsclear(sds s) {
+    struct sdshdr *sh = (void*) (s-(sizeof(struct sdshdr)));
+
+    sh->free += sh->len;
+    sh->len = 0;
+    s[0] = '\0';
+}
+
 /* Grow the sds to have the specified length. Bytes that were not part of
  * the original length of the sds will be set to zero. */
 sds sdsgrowzero(sds s, size_t len) {
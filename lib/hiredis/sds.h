@@ -84,5 +84,8 @@ void sdstoupper(sds s);
 sds sdsfromlonglong(long long value);
 sds sdscatrepr(sds s, char *p, size_t len);
 sds *sdssplitargs(char *line, int *argc);
+sds sdsMakeRoomFor(sds s, size_t addlen);
+void sdsIncrLen(sds s, size_t incr);
+void sdsclear(sds s);
 
 #endif
@@ -9,6 +9,7 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <fcntl.h>
 
 #include "hiredis.h"
 
@@ -36,6 +37,32 @@ static int tests = 0, fails = 0;
 #define test(_s) { printf("#%02d ", ++tests); printf(_s); }
 #define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
 
+/* hiredis is linked into this binary, so with glibc its allocations can be
+ * counted by standing in for the allocator. Sanitizers have their own. */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define HAVE_ALLOC_COUNT
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+static int counting = 0;
+static long long allocs = 0;
+
+void *malloc(size_t size) {
+    if (counting) allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting) allocs++;
+    return __libc_calloc(nmemb,size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) allocs++;
+    return __libc_realloc(ptr,size);
+}
+#endif
+
 static long long usec(void) {
     struct timeval tv;
     gettimeofday(&tv,NULL);
@@ -203,6 +230,73 @@ static void test_format_commands(void) {
     test_cond(strncmp(cmd,"*3\r\n$3\r\nSET\r\n$7\r\nfoo\0xxx\r\n$3\r\nbar\r\n",len) == 0 &&
         len == 4+4+(3+2)+4+(7+2)+4+(3+2));
     free(cmd);
+
+    test("Format command from a template like from its format: ");
+    {
+        const char *fmt = "HSET stream:%s %s%%%d %b %lld:%u";
+        redisCommandTemplate *t = redisCommandTemplateCreate(fmt);
+        char *expected;
+        int elen;
+
+        len = redisFormatTemplate(&cmd,t,"abc","rate",-42,"x\0y",(size_t)3,
+            (long long)1 << 40,7u);
+        elen = redisFormatCommand(&expected,fmt,"abc","rate",-42,"x\0y",(size_t)3,
+            (long long)1 << 40,7u);
+        test_cond(len == elen && memcmp(cmd,expected,len) == 0);
+        free(cmd);
+        free(expected);
+        redisCommandTemplateFree(t);
+    }
+
+    test("Refuse templates with unsupported conversions: ");
+    test_cond(redisCommandTemplateCreate("SET key:%08p %b") == NULL &&
+        redisCommandTemplateCreate("SET %f") == NULL);
+}
+
+static void test_append_no_copy(void) {
+#ifdef HAVE_ALLOC_COUNT
+    static char frame[4096];
+    const char *argv[2] = { "PUBLISH", "stream:test:pipe" };
+    redisContext *c;
+    char sink[16384];
+    size_t expected, received = 0;
+    ssize_t nread;
+    int fds[2], i, done;
+
+    /* Writes go to a pipe that is drained by hand after every frame. The
+     * context only needs somewhere to write, so a failed connect is patched
+     * up to write there. */
+    c = redisConnectUnixNonBlock("/nonexistent/hiredis-test.sock");
+    assert(c != NULL && pipe(fds) == 0);
+    if (c->fd > 0)
+        close(c->fd);
+    c->fd = fds[1];
+    c->err = 0;
+    fcntl(fds[0],F_SETFL,fcntl(fds[0],F_GETFL) | O_NONBLOCK);
+
+    /* The frame extends the last argument. The first frames grow obuf and
+     * the segment ring, the rest must not allocate at all. */
+    expected = 4+(4+7+2)+(7+16+sizeof(frame)+2);
+    for (i = 0; i < 1064; i++) {
+        if (i == 64)
+            counting = 1;
+        if (redisAppendCommandArgvNoCopy(c,2,argv,NULL,frame,sizeof(frame),NULL,NULL) != REDIS_OK)
+            break;
+        do {
+            if (redisBufferWrite(c,&done) != REDIS_OK)
+                break;
+            while ((nread = read(fds[0],sink,sizeof(sink))) > 0)
+                received += nread;
+        } while (!done);
+    }
+    counting = 0;
+
+    test("Send borrowed frames without allocating: ");
+    test_cond(i == 1064 && allocs == 0 && received == expected*1064);
+
+    redisFree(c);
+    close(fds[0]);
+#endif
 }
 
 static void test_reply_reader(void) {
@@ -282,6 +376,76 @@ static void test_reply_reader(void) {
         ((redisReply*)reply)->elements == 0);
     freeReplyObject(reply);
     redisReaderFree(reader);
+
+    test("Keeps long bulk strings in the reader buffer with zero-copy: ");
+    reader = redisReaderCreate();
+    redisReaderSetZeroCopy(reader,5);
+    redisReaderFeed(reader,(char*)"*2\r\n$5\r\nhello\r\n$3\r\nabc\r\n",24);
+    ret = redisReaderGetReply(reader,&reply);
+    test_cond(ret == REDIS_OK &&
+        ((redisReply*)reply)->element[0]->chunk == reader->chunk &&
+        strcmp(((redisReply*)reply)->element[0]->str,"hello") == 0 &&
+        ((redisReply*)reply)->element[1]->chunk == NULL &&
+        strcmp(((redisReply*)reply)->element[1]->str,"abc") == 0);
+
+    test("Zero-copy strings outlive the reader buffer: ");
+    {
+        char big[REDIS_READER_CHUNK_SIZE];
+        void *aux;
+
+        memset(big,'x',sizeof(big));
+        redisReaderFeed(reader,(char*)"$16384\r\n",8);
+        redisReaderFeed(reader,big,sizeof(big));
+        redisReaderFeed(reader,(char*)"\r\n",2);
+        ret = redisReaderGetReply(reader,&aux);
+        redisReaderFree(reader);
+        test_cond(ret == REDIS_OK &&
+            ((redisReply*)aux)->len == (int)sizeof(big) &&
+            ((redisReply*)aux)->str[sizeof(big)] == '\0' &&
+            strcmp(((redisReply*)reply)->element[0]->str,"hello") == 0);
+        freeReplyObject(aux);
+        freeReplyObject(reply);
+    }
+
+    test("Reuses reply objects with pooling: ");
+    {
+        const char *msg = "*3\r\n$7\r\nmessage\r\n$4\r\nfeed\r\n$2\r\nhi\r\n";
+        void *aux;
+
+        reader = redisReaderCreate();
+        redisReaderSetPooling(reader,1);
+        redisReaderFeed(reader,msg,strlen(msg));
+        redisReaderGetReply(reader,&reply);
+        aux = reply;
+        freeReplyObject(reply);
+        redisReaderFeed(reader,msg,strlen(msg));
+        ret = redisReaderGetReply(reader,&reply);
+        redisReaderFree(reader);
+        test_cond(ret == REDIS_OK && reply == aux &&
+            ((redisReply*)reply)->elements == 3 &&
+            strcmp(((redisReply*)reply)->element[2]->str,"hi") == 0);
+        freeReplyObject(reply);
+    }
+
+    test("Skips discarded replies but returns errors: ");
+    {
+        const char *msg = ":1\r\n*2\r\n$3\r\nabc\r\n:2\r\n-ERR x\r\n:3\r\n";
+        void *aux;
+
+        reader = redisReaderCreate();
+        redisReaderDiscard(reader,3);
+        redisReaderFeed(reader,msg,strlen(msg));
+        ret = redisReaderGetReply(reader,&reply);
+        redisReaderGetReply(reader,&aux);
+        test_cond(ret == REDIS_OK && reader->discarded == 2 &&
+            ((redisReply*)reply)->type == REDIS_REPLY_ERROR &&
+            strcmp(((redisReply*)reply)->str,"ERR x") == 0 &&
+            ((redisReply*)aux)->type == REDIS_REPLY_INTEGER &&
+            ((redisReply*)aux)->integer == 3);
+        redisReaderFree(reader);
+        freeReplyObject(reply);
+        freeReplyObject(aux);
+    }
 }
 
 static void test_blocking_connection_errors(void) {
@@ -662,6 +826,7 @@ int main(int argc, char **argv) {
     }
 
     test_format_commands();
+    test_append_no_copy();
     test_reply_reader();
     test_blocking_connection_errors();
 
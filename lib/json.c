@@ -42,6 +42,7 @@
 #endif
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
@@ -64,6 +65,166 @@ static unsigned char hex_value (json_char c)
    }
 }
 
+/* Fast paths for runs of whitespace and of plain string characters. They
+ * return the first character at or after `i' that is not part of the run,
+ * or `end'. The widest variant the CPU supports is picked at runtime.
+ */
+
+typedef const json_char * (* json_scan_fn) (const json_char * i, const json_char * end);
+
+static int scan_is_space (json_char b)
+{
+   return b == ' ' || b == '\t' || b == '\n' || b == '\r';
+}
+
+static int scan_is_special (json_char b)
+{
+   return b == '"' || b == '\\' || ((unsigned char) b) < 0x20;
+}
+
+static const json_char * scan_space_scalar (const json_char * i, const json_char * end)
+{
+   while (i < end && scan_is_space (*i))
+      ++ i;
+
+   return i;
+}
+
+static const json_char * scan_string_scalar (const json_char * i, const json_char * end)
+{
+   while (i < end && !scan_is_special (*i))
+      ++ i;
+
+   return i;
+}
+
+#if !defined(JSON_NO_SIMD) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+   #define JSON_SCAN_X86
+
+   #include <immintrin.h>
+
+   __attribute__ ((target ("sse2")))
+   static const json_char * scan_space_sse2 (const json_char * i, const json_char * end)
+   {
+      const __m128i sp = _mm_set1_epi8 (' '), tab = _mm_set1_epi8 ('\t'),
+                    lf = _mm_set1_epi8 ('\n'), cr = _mm_set1_epi8 ('\r');
+
+      for (; end - i >= 16; i += 16)
+      {
+         __m128i v = _mm_loadu_si128 ((const __m128i *) i);
+         __m128i ws = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, sp), _mm_cmpeq_epi8 (v, tab)),
+                                    _mm_or_si128 (_mm_cmpeq_epi8 (v, lf), _mm_cmpeq_epi8 (v, cr)));
+         unsigned int mask = ~ (unsigned int) _mm_movemask_epi8 (ws) & 0xFFFF;
+
+         if (mask)
+            return i + __builtin_ctz (mask);
+      }
+
+      return scan_space_scalar (i, end);
+   }
+
+   __attribute__ ((target ("sse2")))
+   static const json_char * scan_string_sse2 (const json_char * i, const json_char * end)
+   {
+      const __m128i quote = _mm_set1_epi8 ('"'), bslash = _mm_set1_epi8 ('\\'),
+                    ctrl = _mm_set1_epi8 (0x1F);
+
+      for (; end - i >= 16; i += 16)
+      {
+         __m128i v = _mm_loadu_si128 ((const __m128i *) i);
+         __m128i hit = _mm_or_si128 (_mm_or_si128 (_mm_cmpeq_epi8 (v, quote), _mm_cmpeq_epi8 (v, bslash)),
+                                     _mm_cmpeq_epi8 (_mm_max_epu8 (v, ctrl), ctrl));
+         unsigned int mask = (unsigned int) _mm_movemask_epi8 (hit);
+
+         if (mask)
+            return i + __builtin_ctz (mask);
+      }
+
+      return scan_string_scalar (i, end);
+   }
+
+   __attribute__ ((target ("avx2")))
+   static const json_char * scan_space_avx2 (const json_char * i, const json_char * end)
+   {
+      const __m256i sp = _mm256_set1_epi8 (' '), tab = _mm256_set1_epi8 ('\t'),
+                    lf = _mm256_set1_epi8 ('\n'), cr = _mm256_set1_epi8 ('\r');
+
+      for (; end - i >= 32; i += 32)
+      {
+         __m256i v = _mm256_loadu_si256 ((const __m256i *) i);
+         __m256i ws = _mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, sp), _mm256_cmpeq_epi8 (v, tab)),
+                                       _mm256_or_si256 (_mm256_cmpeq_epi8 (v, lf), _mm256_cmpeq_epi8 (v, cr)));
+         unsigned int mask = ~ (unsigned int) _mm256_movemask_epi8 (ws);
+
+         if (mask)
+            return i + __builtin_ctz (mask);
+      }
+
+      return scan_space_sse2 (i, end);
+   }
+
+   __attribute__ ((target ("avx2")))
+   static const json_char * scan_string_avx2 (const json_char * i, const json_char * end)
+   {
+      const __m256i quote = _mm256_set1_epi8 ('"'), bslash = _mm256_set1_epi8 ('\\'),
+                    ctrl = _mm256_set1_epi8 (0x1F);
+
+      for (; end - i >= 32; i += 32)
+      {
+         __m256i v = _mm256_loadu_si256 ((const __m256i *) i);
+         __m256i hit = _mm256_or_si256 (_mm256_or_si256 (_mm256_cmpeq_epi8 (v, quote), _mm256_cmpeq_epi8 (v, bslash)),
+                                        _mm256_cmpeq_epi8 (_mm256_max_epu8 (v, ctrl), ctrl));
+         unsigned int mask = (unsigned int) _mm256_movemask_epi8 (hit);
+
+         if (mask)
+            return i + __builtin_ctz (mask);
+      }
+
+      return scan_string_sse2 (i, end);
+   }
+
+#endif
+
+static json_scan_fn scan_space = 0;
+static json_scan_fn scan_string = 0;
+
+json_scan_mode json_scan_use (json_scan_mode mode)
+{
+   json_scan_fn space = scan_space_scalar, string = scan_string_scalar;
+   json_scan_mode used = json_scan_scalar;
+
+   #ifdef JSON_SCAN_X86
+
+      __builtin_cpu_init ();
+
+      if ((mode == json_scan_auto || mode == json_scan_avx2)
+            && __builtin_cpu_supports ("avx2"))
+      {
+         space = scan_space_avx2;
+         string = scan_string_avx2;
+         used = json_scan_avx2;
+      }
+      else if (mode != json_scan_scalar && __builtin_cpu_supports ("sse2"))
+      {
+         space = scan_space_sse2;
+         string = scan_string_sse2;
+         used = json_scan_sse2;
+      }
+
+   #endif
+
+   scan_space = space;
+   scan_string = string;
+
+   return used;
+}
+
+static void scan_init (void)
+{
+   json_scan_use (json_scan_auto);
+}
+
 typedef struct
 {
    unsigned long used_memory;
@@ -211,7 +372,7 @@ json_value * json_parse_ex (json_settings * settings,
 {
    json_char error [128];
    unsigned int cur_line;
-   const json_char * cur_line_begin, * i, * end;
+   const json_char * cur_line_begin, * i, * end, * run, * nl;
    json_value * top, * root, * alloc = 0;
    json_state state = { 0 };
    long flags;
@@ -231,6 +392,9 @@ json_value * json_parse_ex (json_settings * settings,
    error[0] = '\0';
    end = (json + length);
 
+   if (!scan_string)
+      scan_init ();
+
    memcpy (&state.settings, settings, sizeof (json_settings));
 
    if (!state.settings.mem_alloc)
@@ -261,7 +425,24 @@ json_value * json_parse_ex (json_settings * settings,
       for (i = json ;; ++ i)
       {
          json_char b = (i == end ? 0 : *i);
-         
+
+         /* Skip runs of whitespace at once wherever they carry no meaning
+          */
+         if (!(flags & flag_string) && scan_is_space (b)
+               && (i + 1) < end && scan_is_space (i [1])
+               && ((flags & (flag_seek_value | flag_done)) || top->type == json_object))
+         {
+            run = scan_space (i, end);
+
+            for (nl = i; (nl = (const json_char *) memchr (nl, '\n', run - nl)); ++ nl)
+            {  ++ cur_line;
+               cur_line_begin = nl;
+            }
+
+            i = run - 1;
+            continue;
+         }
+
          if (flags & flag_done)
          {
             if (!b)
@@ -392,7 +573,24 @@ json_value * json_parse_ex (json_settings * settings,
             }
             else
             {
-               string_add (b);
+               /* Take the whole run of plain characters at once, control
+                * characters still go one by one
+                */
+               run = scan_string (i, end);
+
+               if (run == i)
+               {  string_add (b);
+                  continue;
+               }
+
+               if ((unsigned long) (run - i) > state.uint_max - string_length)
+                  goto e_overflow;
+
+               if (!state.first_pass)
+                  memcpy (string + string_length, i, run - i);
+
+               string_length += (unsigned int) (run - i);
+               i = run - 1;
                continue;
             }
          }
@@ -881,3 +1079,833 @@ void json_value_free (json_value * value)
    json_value_free_ex (&settings, value);
 }
 
+
+
+/* Arena allocation, see json.h
+ */
+
+#define arena_align(size) \
+   (((size) + 15) & ~ (size_t) 15)
+
+typedef struct _json_arena_extra
+{
+   struct _json_arena_extra * next;
+   double data [1];  /* aligned for any value */
+
+} json_arena_extra;
+
+static void * arena_alloc (size_t size, int zero, void * user_data)
+{
+   json_arena * arena = (json_arena *) user_data;
+   json_arena_extra * extra;
+   void * ptr;
+
+   size = arena_align (size);
+
+   if (size <= arena->size - arena->used)
+   {
+      ptr = arena->block + arena->used;
+      arena->used += size;
+   }
+   else
+   {
+      if (! (extra = (json_arena_extra *) malloc
+               (offsetof (json_arena_extra, data) + size)) )
+      {
+         return 0;
+      }
+
+      extra->next = arena->extra;
+      arena->extra = extra;
+      arena->extra_size += size;
+
+      ptr = extra->data;
+   }
+
+   if (zero)
+      memset (ptr, 0, size);
+
+   return ptr;
+}
+
+static void arena_free (void * ptr, void * user_data)
+{
+   /* everything goes back with json_arena_reset */
+}
+
+int json_arena_init (json_arena * arena, size_t size)
+{
+   memset (arena, 0, sizeof (json_arena));
+
+   size = arena_align (size);
+
+   if (size && ! (arena->block = (char *) malloc (size)))
+      return 0;
+
+   arena->size = size;
+   return 1;
+}
+
+void json_arena_settings (json_arena * arena, json_settings * settings)
+{
+   settings->mem_alloc = arena_alloc;
+   settings->mem_free = arena_free;
+   settings->user_data = arena;
+}
+
+void json_arena_reset (json_arena * arena)
+{
+   json_arena_extra * extra;
+   char * block;
+   size_t size;
+
+   if (arena->extra)
+   {
+      while ((extra = arena->extra))
+      {
+         arena->extra = extra->next;
+         free (extra);
+      }
+
+      /* Make room for the parse that overflowed
+       */
+      size = arena->size + arena->extra_size;
+
+      if ((block = (char *) realloc (arena->block, size)))
+      {
+         arena->block = block;
+         arena->size = size;
+      }
+
+      arena->extra_size = 0;
+   }
+
+   arena->used = 0;
+}
+
+void json_arena_free (json_arena * arena)
+{
+   json_arena_reset (arena);
+   free (arena->block);
+   memset (arena, 0, sizeof (json_arena));
+}
+
+
+/* Event-driven parsing, see json.h
+ */
+
+#define sax_emit(callback, ...) \
+   do { if (handler->callback && handler->callback (handler->user_data, __VA_ARGS__)) \
+           return json_sax_stopped; } while (0)
+
+#define sax_close(b) \
+   ((b) == '{' ? '}' : ']')
+
+static const json_char * sax_skip (const json_char * i, const json_char * end)
+{
+   if (i < end && scan_is_space (*i))
+      i = scan_space (i + 1, end);
+
+   return i;
+}
+
+/* Scans a string whose opening quote was already consumed. Returns the
+ * character after the closing quote, or 0 if the input ends first.
+ */
+static const json_char * sax_string (const json_char * i, const json_char * end, int * escaped)
+{
+   *escaped = 0;
+
+   for (;;)
+   {
+      i = scan_string (i, end);
+
+      if (i == end)
+         return 0;
+
+      if (*i == '"')
+         return i + 1;
+
+      if (*i == '\\')
+      {
+         *escaped = 1;
+
+         if (++ i == end)
+            return 0;
+      }
+
+      ++ i;
+   }
+}
+
+/* Same number grammar as json_parse_ex. Returns the character after the
+ * number, or 0 if it is not a valid one.
+ */
+static const json_char * sax_number (const json_char * i, const json_char * end, json_sax_value * value)
+{
+   int negative = 0, e_negative = 0;
+   long num_digits = 0, num_e = 0;
+   json_int_t num_fraction = 0;
+
+   value->type = json_integer;
+   value->u.integer = 0;
+
+   if (*i == '-')
+   {
+      negative = 1;
+      ++ i;
+   }
+
+   if (i == end || !isdigit (*i))
+      return 0;
+
+   if (*i == '0' && (i + 1) < end && isdigit (i [1]))
+      return 0;
+
+   while (i < end && isdigit (*i))
+      value->u.integer = (value->u.integer * 10) + (*i ++ - '0');
+
+   if (i < end && *i == '.')
+   {
+      value->type = json_double;
+      value->u.dbl = (double) value->u.integer;
+
+      for (++ i; i < end && isdigit (*i); ++ i, ++ num_digits)
+         num_fraction = (num_fraction * 10) + (*i - '0');
+
+      if (!num_digits)
+         return 0;
+
+      value->u.dbl += ((double) num_fraction) / (pow (10, (double) num_digits));
+   }
+
+   if (i < end && (*i == 'e' || *i == 'E'))
+   {
+      if (value->type == json_integer)
+      {
+         value->type = json_double;
+         value->u.dbl = (double) value->u.integer;
+      }
+
+      if (++ i < end && (*i == '+' || *i == '-'))
+         e_negative = (*i ++ == '-');
+
+      if (i == end || !isdigit (*i))
+         return 0;
+
+      while (i < end && isdigit (*i))
+         num_e = (num_e * 10) + (*i ++ - '0');
+
+      value->u.dbl *= pow (10, (double) (e_negative ? - num_e : num_e));
+   }
+
+   if (negative)
+   {
+      if (value->type == json_integer)
+         value->u.integer = - value->u.integer;
+      else
+         value->u.dbl = - value->u.dbl;
+   }
+
+   return i;
+}
+
+json_sax_result json_sax_parse (const json_sax_handler * handler,
+                                const json_char * json,
+                                size_t length,
+                                char * error_buf)
+{
+   json_char error [128];
+   unsigned char stack [json_sax_max_depth];
+   unsigned int depth = 0;
+   const json_char * i, * end, * start;
+   json_sax_value value;
+   int escaped;
+
+   /* Skip UTF-8 BOM
+    */
+   if (length >= 3 && ((unsigned char) json [0]) == 0xEF
+                   && ((unsigned char) json [1]) == 0xBB
+                   && ((unsigned char) json [2]) == 0xBF)
+   {
+      json += 3;
+      length -= 3;
+   }
+
+   error[0] = '\0';
+   end = (json + length);
+   i = json;
+
+   if (!scan_string)
+      scan_init ();
+
+seek_value:
+
+   i = sax_skip (i, end);
+
+   if (i == end)
+      goto e_eof;
+
+   switch (*i)
+   {
+      case '{':
+      case '[':
+
+         if (depth == json_sax_max_depth)
+         {  sprintf (error, "%d: Too deep", (int) (i - json));
+            goto e_failed;
+         }
+
+         if (*i == '{')
+            sax_emit (object_start, depth);
+         else
+            sax_emit (array_start, depth);
+
+         stack [depth ++] = *i ++;
+
+         i = sax_skip (i, end);
+
+         if (i < end && *i == sax_close (stack [depth - 1]))
+            goto close;
+
+         if (stack [depth - 1] == '{')
+            goto seek_key;
+
+         goto seek_value;
+
+      case '"':
+
+         start = ++ i;
+
+         if (! (i = sax_string (i, end, &escaped)))
+            goto e_eof;
+
+         value.type = json_string;
+         value.u.string.ptr = start;
+         value.u.string.length = (unsigned int) (i - 1 - start);
+         value.u.string.escaped = escaped;
+         break;
+
+      case 't':
+
+         if ((end - i) < 4 || memcmp (i, "true", 4))
+            goto e_unknown_value;
+
+         value.type = json_boolean;
+         value.u.boolean = 1;
+         i += 4;
+         break;
+
+      case 'f':
+
+         if ((end - i) < 5 || memcmp (i, "false", 5))
+            goto e_unknown_value;
+
+         value.type = json_boolean;
+         value.u.boolean = 0;
+         i += 5;
+         break;
+
+      case 'n':
+
+         if ((end - i) < 4 || memcmp (i, "null", 4))
+            goto e_unknown_value;
+
+         value.type = json_null;
+         i += 4;
+         break;
+
+      default:
+
+         if (isdigit (*i) || *i == '-')
+         {
+            start = i;
+
+            if (! (i = sax_number (i, end, &value)))
+            {  sprintf (error, "%d: Invalid number", (int) (start - json));
+               goto e_failed;
+            }
+
+            break;
+         }
+
+         sprintf (error, "%d: Unexpected %c when seeking value", (int) (i - json), *i);
+         goto e_failed;
+   };
+
+   sax_emit (value, depth, &value);
+
+next:
+
+   i = sax_skip (i, end);
+
+   if (!depth)
+   {
+      if (i != end)
+      {  sprintf (error, "%d: Trailing garbage: `%c`", (int) (i - json), *i);
+         goto e_failed;
+      }
+
+      return json_sax_done;
+   }
+
+   if (i == end)
+      goto e_eof;
+
+   if (*i == ',')
+   {
+      ++ i;
+
+      if (stack [depth - 1] == '{')
+         goto seek_key;
+
+      goto seek_value;
+   }
+
+   if (*i == sax_close (stack [depth - 1]))
+      goto close;
+
+   sprintf (error, "%d: Expected , or %c before %c", (int) (i - json), sax_close (stack [depth - 1]), *i);
+   goto e_failed;
+
+close:
+
+   ++ i;
+
+   if (stack [-- depth] == '{')
+      sax_emit (object_end, depth);
+   else
+      sax_emit (array_end, depth);
+
+   goto next;
+
+seek_key:
+
+   i = sax_skip (i, end);
+
+   if (i == end)
+      goto e_eof;
+
+   if (*i != '"')
+   {  sprintf (error, "%d: Unexpected `%c` in object", (int) (i - json), *i);
+      goto e_failed;
+   }
+
+   start = ++ i;
+
+   if (! (i = sax_string (i, end, &escaped)))
+      goto e_eof;
+
+   sax_emit (key, depth, start, (unsigned int) (i - 1 - start), escaped);
+
+   i = sax_skip (i, end);
+
+   if (i == end || *i != ':')
+   {  sprintf (error, "%d: Expected : after key", (int) (i - json));
+      goto e_failed;
+   }
+
+   ++ i;
+   goto seek_value;
+
+e_unknown_value:
+
+   sprintf (error, "%d: Unknown value", (int) (i - json));
+   goto e_failed;
+
+e_eof:
+
+   strcpy (error, "Unexpected EOF");
+   goto e_failed;
+
+e_failed:
+
+   if (error_buf)
+   {
+      if (*error)
+         strcpy (error_buf, error);
+      else
+         strcpy (error_buf, "Unknown error");
+   }
+
+   return json_sax_error;
+}
+
+
+/* Serialization, see json.h
+ */
+
+static const char writer_hex [] = "0123456789abcdef";
+
+/* Two digits at a time, "00" to "99"
+ */
+static const char writer_digits [] =
+      "00010203040506070809"
+      "10111213141516171819"
+      "20212223242526272829"
+      "30313233343536373839"
+      "40414243444546474849"
+      "50515253545556575859"
+      "60616263646566676869"
+      "70717273747576777879"
+      "80818283848586878889"
+      "90919293949596979899";
+
+/* Zero for characters written as they are, 'u' for \u00XX, anything else
+ * follows a backslash
+ */
+static const json_char writer_escapes [256] =
+{
+   'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+   'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+   0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\'
+};
+
+static const double writer_pow10 [] =
+{
+   1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+static int writer_reserve (json_writer * writer, size_t length)
+{
+   json_char * buffer;
+   size_t size;
+
+   if (writer->error)
+      return 0;
+
+   /* one more for the terminator */
+   if (writer->length + length < writer->size)
+      return 1;
+
+   size = writer->size ? writer->size : 64;
+
+   while (size <= writer->length + length)
+      size *= 2;
+
+   if (! (buffer = (json_char *) realloc (writer->buffer, size)))
+   {
+      writer->error = 1;
+      return 0;
+   }
+
+   writer->buffer = buffer;
+   writer->size = size;
+
+   return 1;
+}
+
+/* Makes room for a value and writes the comma in front of it if any
+ */
+static int writer_value (json_writer * writer, size_t length)
+{
+   if (! writer_reserve (writer, length + 1))
+      return 0;
+
+   if (writer->after_key)
+      writer->after_key = 0;
+   else if (writer->depth)
+   {
+      if (! writer->first [writer->depth - 1])
+         writer->buffer [writer->length ++] = ',';
+
+      writer->first [writer->depth - 1] = 0;
+   }
+
+   return 1;
+}
+
+static void writer_open (json_writer * writer, json_char open, json_char close)
+{
+   if (writer->depth == json_writer_max_depth)
+   {
+      writer->error = 1;
+      return;
+   }
+
+   if (! writer_value (writer, 1))
+      return;
+
+   writer->buffer [writer->length ++] = open;
+   writer->buffer [writer->length] = 0;
+
+   writer->close [writer->depth] = close;
+   writer->first [writer->depth ++] = 1;
+}
+
+/* Writes the digits of number so that they end at end, and returns where
+ * they start
+ */
+static json_char * writer_digits_of (json_char * end, unsigned long long number)
+{
+   unsigned int pair;
+
+   while (number >= 100)
+   {
+      pair = (unsigned int) (number % 100) * 2;
+      number /= 100;
+
+      *-- end = writer_digits [pair + 1];
+      *-- end = writer_digits [pair];
+   }
+
+   if (number >= 10)
+   {
+      pair = (unsigned int) number * 2;
+
+      *-- end = writer_digits [pair + 1];
+      *-- end = writer_digits [pair];
+   }
+   else
+      *-- end = (json_char) ('0' + number);
+
+   return end;
+}
+
+static void writer_string (json_writer * writer, const json_char * string, size_t length)
+{
+   const json_char * end = string + length, * run;
+   json_char * out;
+   unsigned char c;
+
+   writer->buffer [writer->length ++] = '"';
+
+   for (;;)
+   {
+      for (run = string; run < end && ! writer_escapes [(unsigned char) *run]; ++ run);
+
+      /* the run, one escape and the closing quote */
+      if (! writer_reserve (writer, (run - string) + 7))
+         return;
+
+      memcpy (writer->buffer + writer->length, string, run - string);
+      writer->length += run - string;
+
+      if (run == end)
+         break;
+
+      c = (unsigned char) *run;
+      out = writer->buffer + writer->length;
+
+      *out ++ = '\\';
+      *out ++ = writer_escapes [c];
+
+      if (writer_escapes [c] == 'u')
+      {
+         *out ++ = '0';
+         *out ++ = '0';
+         *out ++ = writer_hex [c >> 4];
+         *out ++ = writer_hex [c & 15];
+      }
+
+      writer->length = out - writer->buffer;
+      string = run + 1;
+   }
+
+   writer->buffer [writer->length ++] = '"';
+   writer->buffer [writer->length] = 0;
+}
+
+int json_writer_init (json_writer * writer, size_t size)
+{
+   memset (writer, 0, sizeof (json_writer));
+
+   if (size && ! (writer->buffer = (json_char *) malloc (size)))
+      return 0;
+
+   if (size)
+      * writer->buffer = 0;
+
+   writer->size = size;
+   return 1;
+}
+
+void json_writer_reset (json_writer * writer)
+{
+   writer->length = 0;
+   writer->depth = 0;
+   writer->after_key = 0;
+   writer->error = 0;
+
+   if (writer->buffer)
+      * writer->buffer = 0;
+}
+
+void json_writer_free (json_writer * writer)
+{
+   free (writer->buffer);
+   memset (writer, 0, sizeof (json_writer));
+}
+
+void json_write_object (json_writer * writer)
+{
+   writer_open (writer, '{', '}');
+}
+
+void json_write_array (json_writer * writer)
+{
+   writer_open (writer, '[', ']');
+}
+
+void json_write_end (json_writer * writer)
+{
+   if (! writer->depth || writer->after_key)
+   {
+      writer->error = 1;
+      return;
+   }
+
+   if (! writer_reserve (writer, 1))
+      return;
+
+   writer->buffer [writer->length ++] = writer->close [-- writer->depth];
+   writer->buffer [writer->length] = 0;
+}
+
+void json_write_key (json_writer * writer, const json_char * key, size_t length)
+{
+   if (! writer_value (writer, length + 2))
+      return;
+
+   writer_string (writer, key, length);
+
+   if (! writer_reserve (writer, 1))
+      return;
+
+   writer->buffer [writer->length ++] = ':';
+   writer->buffer [writer->length] = 0;
+
+   writer->after_key = 1;
+}
+
+void json_write_string (json_writer * writer, const json_char * string, size_t length)
+{
+   if (! writer_value (writer, length + 2))
+      return;
+
+   writer_string (writer, string, length);
+}
+
+void json_write_integer (json_writer * writer, json_int_t integer)
+{
+   json_char digits [24], * start, * end = digits + sizeof (digits);
+
+   start = writer_digits_of (end, integer < 0 ? 0 - (unsigned long long) integer
+                                              : (unsigned long long) integer);
+   if (integer < 0)
+      *-- start = '-';
+
+   json_write_raw (writer, start, end - start);
+}
+
+void json_write_double (json_writer * writer, double dbl)
+{
+   json_char digits [24], * start, * end = digits + sizeof (digits), * out;
+   unsigned long long whole;
+   unsigned int decimals;
+   double magnitude, scaled;
+   size_t length;
+
+   /* JSON has no NaN or infinity */
+   if (dbl != dbl || dbl - dbl != 0)
+   {
+      json_write_null (writer);
+      return;
+   }
+
+   if (! writer_value (writer, 32))
+      return;
+
+   out = writer->buffer + writer->length;
+   magnitude = dbl < 0 ? - dbl : dbl;
+
+   /* Most values have a short exact decimal form: the smallest power of ten
+    * that turns them into an integer which divides back to the same double
+    */
+   for (decimals = 0; decimals < sizeof (writer_pow10) / sizeof (double); ++ decimals)
+   {
+      scaled = magnitude * writer_pow10 [decimals];
+
+      if (scaled >= 9007199254740992.0)  /* 2^53 */
+         break;
+
+      whole = (unsigned long long) scaled;
+
+      if ((double) whole != scaled || (double) whole / writer_pow10 [decimals] != magnitude)
+         continue;
+
+      start = writer_digits_of (end, whole);
+      length = end - start;
+
+      if (dbl < 0)
+         *out ++ = '-';
+
+      if (length <= decimals)
+      {
+         *out ++ = '0';
+         *out ++ = '.';
+
+         for (; length < decimals; ++ length)
+            *out ++ = '0';
+
+         memcpy (out, start, end - start);
+         out += end - start;
+      }
+      else
+      {
+         memcpy (out, start, length - decimals);
+         out += length - decimals;
+         *out ++ = '.';
+
+         if (decimals)
+         {
+            memcpy (out, end - decimals, decimals);
+            out += decimals;
+         }
+         else
+            *out ++ = '0';
+      }
+
+      writer->length = out - writer->buffer;
+      writer->buffer [writer->length] = 0;
+      return;
+   }
+
+   length = sprintf (out, "%.17g", dbl);
+
+   /* keep it a double when read back */
+   if (! strpbrk (out, ".e"))
+   {
+      out [length ++] = '.';
+      out [length ++] = '0';
+      out [length] = 0;
+   }
+
+   writer->length += length;
+}
+
+void json_write_boolean (json_writer * writer, int boolean)
+{
+   if (boolean)
+      json_write_raw (writer, "true", 4);
+   else
+      json_write_raw (writer, "false", 5);
+}
+
+void json_write_null (json_writer * writer)
+{
+   json_write_raw (writer, "null", 4);
+}
+
+void json_write_raw (json_writer * writer, const json_char * json, size_t length)
+{
+   if (! writer_value (writer, length))
+      return;
+
+   memcpy (writer->buffer + writer->length, json, length);
+   writer->length += length;
+   writer->buffer [writer->length] = 0;
+}
@@ -259,6 +259,201 @@ void json_value_free_ex (json_settings * settings,
                          json_value *);
 
 
+/* Arena allocation: json_arena_settings fills a json_settings so that every
+ * value of a parse comes out of one reusable block. Nothing needs to be
+ * freed afterwards, json_arena_reset hands the whole block back at once.
+ *
+ *    json_arena arena;
+ *    json_settings settings = { 0 };
+ *
+ *    json_arena_init (&arena, 4096);
+ *    json_arena_settings (&arena, &settings);
+ *
+ *    value = json_parse_ex (&settings, json, length, error);
+ *    ...
+ *    json_arena_reset (&arena);
+ *
+ * A parse that does not fit takes extra blocks from malloc, and the next
+ * reset grows the main block so that the same parse fits from then on.
+ */
+
+typedef struct _json_arena
+{
+   char * block;
+   size_t size;
+   size_t used;
+
+   struct _json_arena_extra * extra;  /* blocks taken since the last reset */
+   size_t extra_size;
+
+} json_arena;
+
+int json_arena_init (json_arena * arena, size_t size);
+
+void json_arena_settings (json_arena * arena, json_settings * settings);
+
+void json_arena_reset (json_arena * arena);
+
+void json_arena_free (json_arena * arena);
+
+
+/* Event-driven parsing: keys and values are reported to the handler while
+ * the input is scanned, and no json_value is ever allocated.
+ *
+ * Strings point into the input and are not null terminated. When they
+ * contain escape sequences, `escaped' is set and they are left as written.
+ * Depth is the number of arrays and objects around the item, so the keys
+ * of the root object are reported at depth 1.
+ *
+ * Every callback is optional. Returning nonzero from one stops the scan.
+ */
+
+#ifndef json_sax_max_depth
+   #define json_sax_max_depth 64
+#endif
+
+typedef struct
+{
+   json_type type;
+
+   union
+   {
+      int boolean;
+      json_int_t integer;
+      double dbl;
+
+      struct
+      {
+         unsigned int length;
+         const json_char * ptr;
+         int escaped;
+
+      } string;
+
+   } u;
+
+} json_sax_value;
+
+typedef struct
+{
+   int (* object_start) (void * user_data, unsigned int depth);
+   int (* object_end) (void * user_data, unsigned int depth);
+   int (* array_start) (void * user_data, unsigned int depth);
+   int (* array_end) (void * user_data, unsigned int depth);
+
+   int (* key) (void * user_data, unsigned int depth,
+                const json_char * key, unsigned int length, int escaped);
+
+   int (* value) (void * user_data, unsigned int depth,
+                  const json_sax_value * value);
+
+   void * user_data;  /* will be passed to every callback */
+
+} json_sax_handler;
+
+typedef enum
+{
+   json_sax_error,    /* error is filled in when given */
+   json_sax_done,     /* the whole document was scanned */
+   json_sax_stopped   /* a callback returned nonzero */
+
+} json_sax_result;
+
+json_sax_result json_sax_parse (const json_sax_handler * handler,
+                                const json_char * json,
+                                size_t length,
+                                char * error);
+
+
+/* Whitespace and string runs are scanned 16 or 32 bytes at a time when the
+ * CPU allows it. json_scan_auto, the default, picks the widest scanner
+ * available; the others are there to compare them. A CPU without the one
+ * asked for gets the next narrower, and the one in use is returned.
+ */
+
+typedef enum
+{
+   json_scan_auto,
+   json_scan_scalar,
+   json_scan_sse2,
+   json_scan_avx2
+
+} json_scan_mode;
+
+json_scan_mode json_scan_use (json_scan_mode mode);
+
+
+/* Serialization: json_writer appends one document at a time to a buffer that
+ * is kept from one document to the next. Commas, colons and string escapes
+ * are written as needed.
+ *
+ *    json_writer writer;
+ *
+ *    json_writer_init (&writer, 256);
+ *
+ *    json_writer_reset (&writer);
+ *    json_write_object (&writer);
+ *    json_write_key (&writer, "frameRate", 9);
+ *    json_write_integer (&writer, 60);
+ *    json_write_end (&writer);
+ *
+ *    if (! writer.error)
+ *       send (writer.buffer, writer.length);
+ *
+ * Once the buffer has grown to the largest document written, nothing more
+ * is allocated. When growing fails, error is set and later writes are
+ * ignored until the next reset.
+ */
+
+#ifndef json_writer_max_depth
+   #define json_writer_max_depth 32
+#endif
+
+typedef struct _json_writer
+{
+   json_char * buffer;  /* null terminated */
+   size_t length;
+   size_t size;
+
+   unsigned int depth;
+   json_char close [json_writer_max_depth];
+   unsigned char first [json_writer_max_depth];  /* nothing written yet */
+   int after_key;
+
+   int error;
+
+} json_writer;
+
+int json_writer_init (json_writer * writer, size_t size);
+
+void json_writer_reset (json_writer * writer);
+
+void json_writer_free (json_writer * writer);
+
+void json_write_object (json_writer * writer);
+void json_write_array (json_writer * writer);
+void json_write_end (json_writer * writer);
+
+void json_write_key (json_writer * writer,
+                     const json_char * key,
+                     size_t length);
+
+void json_write_string (json_writer * writer,
+                        const json_char * string,
+                        size_t length);
+
+void json_write_integer (json_writer * writer, json_int_t integer);
+void json_write_double (json_writer * writer, double dbl);
+void json_write_boolean (json_writer * writer, int boolean);
+void json_write_null (json_writer * writer);
+
+/* Copies an already serialized value as it is
+ */
+void json_write_raw (json_writer * writer,
+                     const json_char * json,
+                     size_t length);
+
+
 #ifdef __cplusplus
    } /* extern "C" */
 #endif
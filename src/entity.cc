@@ -54,6 +54,10 @@ Entity::Entity (redisAsyncContext *c,
     this->interval.tv_usec = 0;
     this->priv = NULL;
 
+    memset(&(this->jsonSettings), 0, sizeof(json_settings));
+    json_arena_init(&(this->arena), ENTITY_ARENA_SIZE);
+    json_arena_settings(&(this->arena), &(this->jsonSettings));
+
     redisAsyncCommand(c, _onFreeMe, NULL, "MULTI");
     redisAsyncCommand(c, _onFreeMe, NULL, "SADD %s %s", this->type, this->id);
 
@@ -208,89 +212,85 @@ void _onMessage (redisAsyncContext *c,
 {
     Entity *s  = priv;
     redisReply *reply = r;
-    int i = 0;
+    redisReply *payload;
+    Stream_feed_t feed;
+    json_value *root;
     json_value *data = NULL;
-    bool updating = false;
-    bool valid = true;
+    char error[128];
+    unsigned int i;
 
     if (reply == NULL) return;
 
-    printf("Hey, we got a message!\n");
+    if (reply->type != REDIS_REPLY_ARRAY ||
+        reply->elements != 3 ||
+        reply->element[0]->type != REDIS_REPLY_STRING) {
+        Log_warn("Unexpected reply on the feed of %s", s->id);
+        return;
+    }
 
-    if (reply->type == REDIS_REPLY_ARRAY &&
-        reply->elements == 3 &&
-        strcmp(reply->element[0]->str, "subscribe") != 0 &&
-        reply->element[2]->type == REDIS_REPLY_STRING) {
+    if (strcmp(reply->element[0]->str, "subscribe") == 0) {
+        Log_debug("Subscribed to the feed of %s", s->id);
+        return;
+    }
 
-            printf("Seems legit...\n");
+    payload = reply->element[2];
+    if (payload->type != REDIS_REPLY_STRING) {
+        Log_warn("Unexpected message on the feed of %s", s->id);
+        return;
+    }
 
-            json_value *root = json_parse(
-                reply->element[2]->str,
-                reply->element[2]->len
-            );
+    // Our own echoes and anything but updates never get to the tree, the
+    // pre-scan stops at the clientID
+    if (Stream_scanFeed(payload->str, payload->len, &feed) != 0) return;
 
-            if (root == NULL) {
-                printf("Oops! Malformed JSON sequence.\n");
-                json_value_free(root);
-                return;
-            }
+    // Attributes can be of any type, so this one needs the whole tree
+    root = json_parse_ex(&(s->jsonSettings), payload->str, payload->len, error);
+    if (root == NULL || root->type != json_object) {
+        Log_warn("Malformed JSON on the feed of %s", s->id);
+        json_arena_reset(&(s->arena));
+        return;
+    }
 
-            for (i = 0; i < root->u.object.length; ++i) {
-                json_char *name = root->u.object.values[i].name;
-                json_value *value = root->u.object.values[i].value;
-                if (strcmp(name, CLIENT_ID) == 0) {
-                    printf("Ouch. It was mine.\n");
-                    valid = false;
-                    break;
-                } else if (strcmp(name, "data") == 0) {
-                    data = value;
-                } else if (strcmp(name, "method") == 0 &&
-                           strcmp(value->u.string.ptr, "update") == 0) {
-                    printf("And it's an update. Good.\n");
-                    updating = true;
-                }
-            }
+    for (i = 0; i < root->u.object.length; ++i) {
+        json_char *name = root->u.object.values[i].name;
+        json_value *value = root->u.object.values[i].value;
 
-            if (valid && updating && data != NULL) {
-                printf("Cool! Let's decode it.\n");
-                for (i = 0; i < data->u.object.length; ++i) {
-                    json_char *name = data->u.object.values[i].name;
-                    json_value *value = data->u.object.values[i].value;
-
-                    if (strcmp(name, "frameLength") == 0) {
-                        s->frameLength = (int) value->u.integer;
-                        printf("Updated frameLength: %d\n", s->frameLength);
-                    } else if (strcmp(name, "frameRate") == 0) {
-                        int rate = (int) value->u.integer;
-                        double interval = 1.0 / rate;
-                        time_t sec = (time_t) floor(interval);
-                        suseconds_t usec = (suseconds_t) floor((interval-sec) * 1e6);
-                        s->frameRate = rate;
-                        s->interval.tv_sec = sec;
-                        s->interval.tv_usec = usec;
-                        printf("Updated frameRate: %d\n", s->frameRate);
-                    } else if (strcmp(name, "dimensions") == 0) {
-                        s->dimensions = (int) value->u.integer;
-                        printf("Updated dimensions: %d\n", s->dimensions);
-                    }
-
-                    if (s->onUpdated != NULL) {
-                        s->onUpdated(s);
-                    }
-                }
-            }
+        if (Stream_lookupAttr(name, strlen(name)) == STREAM_ATTR_DATA) {
+            data = value;
+        }
+    }
 
-            json_value_free(root);
+    // The pre-scan made sure this is an update from somebody else
+    if (data != NULL && data->type == json_object) {
+        for (i = 0; i < data->u.object.length; ++i) {
+            json_char *name = data->u.object.values[i].name;
+            json_value *value = data->u.object.values[i].value;
+            attr_map::iterator it = s->attrs.find(name);
 
-    } else {
+            if (it == s->attrs.end()) continue;
 
-        printf("Ouch. Reply not valid:\n");
-        int i;
-        for (i = 0; i < reply->elements; i++) {
-            printf("    %s\n", reply->element[i]->str);
-        }
+            switch (value->type) {
+                case json_string:
+                    parse(&(it->second), string(value->u.string.ptr,
+                                                value->u.string.length));
+                    break;
+                case json_integer:
+                    parse(&(it->second), to_string(value->u.integer));
+                    break;
+                default:
+                    continue;
+            }
 
+            Log_debug("Updated %s of %s", name, s->id);
+
+            if (s->onUpdated != NULL) {
+                s->onUpdated(s);
+            }
+        }
     }
+
+    // Drops the whole tree at once
+    json_arena_reset(&(s->arena));
 }
 
 
@@ -28,6 +28,10 @@
  #define CLIENT_ID "c_entity"     // Default feedback rejection ID
 #endif
 
+#ifndef ENTITY_ARENA_SIZE
+ #define ENTITY_ARENA_SIZE 4096   // Initial bytes for parsing feed messages
+#endif
+
 /*
  * This is the Entity dictionary
  * The attributes are predefined
@@ -53,6 +57,9 @@ typedef std::pair<std::string, attr_value> attr;
 class Entity {
 public:
     attribute_map attrs;
+    // Attributes not sent to Redis yet. Stream_t.dirty does the same job as
+    // a bitmask, Stream attributes are a fixed Stream_attr_t set while these
+    // are free-form names, so the two can't share one representation
     attribute_map changedAttrs;
     char *id;
     redisAsyncContext *redisContext;
@@ -61,6 +68,8 @@ public:
     void (*onPolled)(Entity *);
     struct event timer;
     struct timeval interval;
+    json_arena arena;            // Feed messages are parsed in here
+    json_settings jsonSettings;
     void *priv;
 
     Entity(redisAsyncContext *c,
@@ -0,0 +1,68 @@
+/*
+ * LOG macros
+ * Leveled logging to stderr for the Stream and Entity classes
+ * Messages above LOG_LEVEL compile to nothing, arguments included,
+ * so the hot paths can log freely without paying for it
+ */
+
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+
+/*
+ * Define the levels, from quietest to noisiest
+ */
+
+#define LOG_LEVEL_NONE  0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN  2
+#define LOG_LEVEL_INFO  3
+#define LOG_LEVEL_DEBUG 4
+
+/*
+ * Define some compile-time constants
+ */
+
+#ifndef LOG_LEVEL
+ #define LOG_LEVEL LOG_LEVEL_ERROR    // Silent unless something is broken
+#endif
+
+#ifndef LOG_PREFIX
+ #define LOG_PREFIX "repovizz"        // Printed before every message
+#endif
+
+/*
+ * The logging macros, printf-like
+ */
+
+#define _LOG(tag, ...) do { \
+        fprintf(stderr, "[" LOG_PREFIX "] " tag ": " __VA_ARGS__); \
+        fputc('\n', stderr); \
+    } while (0)
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+ #define Log_error(...) _LOG("error", __VA_ARGS__)
+#else
+ #define Log_error(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+ #define Log_warn(...) _LOG("warn", __VA_ARGS__)
+#else
+ #define Log_warn(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+ #define Log_info(...) _LOG("info", __VA_ARGS__)
+#else
+ #define Log_info(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+ #define Log_debug(...) _LOG("debug", __VA_ARGS__)
+#else
+ #define Log_debug(...) do {} while (0)
+#endif
+
+#endif
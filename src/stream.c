@@ -1,3 +1,8 @@
+#include <endian.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <time.h>
+
 #include "stream.h"
 
 /***********************
@@ -6,17 +11,199 @@
 
 static void _onCreated (redisAsyncContext *c, void *r, void *priv);
 
+static void _onCreatedMany (redisAsyncContext *c, void *r, void *priv);
+
+static void _onScriptLoaded (redisAsyncContext *c, void *r, void *priv);
+
+static void _onEvalReply (redisAsyncContext *c, void *r, void *priv);
+
 static void _onMessage (redisAsyncContext *c, void *r, void *priv);
 
-static void _onFreeMe (redisAsyncContext *c, void *r, void *priv);
+static void _onFeed (Stream_t *s, redisReply *payload);
 
 static void _onFreeUs (redisAsyncContext *c, void *r, void *priv);
 
-static void _onTimeout (int fd, short ev, void *priv);
+static void _onTick (void *priv);
+
+static void _onFlush (int fd, short event, void *priv);
+
+static void _onSent (void *data, void *priv);
+
+static void _onSlotSent (void *data, void *priv);
+
+static Stream_ring_t* _ring_create (int slots, size_t length);
+
+static void _ring_unref (Stream_ring_t *ring);
+
+static void _ring_release (Stream_ring_t *ring, char *frame);
+
+static Stream_t* _alloc (redisAsyncContext *c, char *id);
+
+static void _free (Stream_t *s);
+
+static int _register (redisAsyncContext *c, Stream_t **streams, int count);
+
+static void _fillHeader (Stream_t *s, Stream_header_t *h, size_t length);
+
+static uint64_t _timestamp (void);
+
+static int _offer (Stream_t *s, Stream_held_t *frame);
+
+static int _publish (Stream_t *s, Stream_held_t *frame);
+
+static Stream_held_t* _backlog_shift (Stream_t *s);
+
+static void _drop (Stream_held_t *frame);
+
+static uint32_t _hash (const char *str, size_t len);
+
+static Stream_router_t* _router_get (redisAsyncContext *subs);
+
+static int _router_add (Stream_router_t *router, Stream_t *s);
+
+static Stream_t* _router_find (Stream_router_t *router,
+                               const char *id, size_t len);
+
+static void _setRate (Stream_t *s, int rate);
+
+static int _setAttr (Stream_t *s, Stream_attr_t attr, int value);
+
+static int _setAttrs (Stream_t *s, uint32_t mask, const int *values);
+
+static int _getAttr (Stream_t *s, Stream_attr_t attr);
+
+static const char* _attrName (Stream_attr_t attr);
+
+static void _markDirty (Stream_t *s, uint32_t fields);
+
+static void _flushAttrs (Stream_t *s);
+
+static void _evalAttrs (Stream_t *s, uint32_t fields, int argc,
+                        const char **argv, const size_t *argvlen,
+                        const char *message, size_t length);
+
+static json_writer* _eventBegin (Stream_t *s, const char *method);
+
+static int _eventSend (Stream_t *s, json_writer *w);
+
+static void _writeAttrs (json_writer *w, Stream_t *s, uint32_t mask);
+
+static int _onFeedObject (void *priv, unsigned int depth);
+
+static int _onFeedObjectEnd (void *priv, unsigned int depth);
+
+static int _onFeedKey (void *priv, unsigned int depth,
+                       const char *key, unsigned int len, int escaped);
+
+static int _onFeedValue (void *priv, unsigned int depth,
+                         const json_sax_value *value);
+
+static redisCommandTemplate* _template (redisCommandTemplate **t,
+                                       const char *format);
 
 static char* _super_print(const char *fmt, ...);
 
 
+/*
+ * Every name a feed message may carry, placed by a perfect hash
+ * Stream_lookupAttr sends each of them to its own slot, so a lookup costs one
+ * hash, one length check and one memcmp
+ */
+
+#define ATTR_SLOTS 16
+
+static const Stream_attr_entry_t attrs[ATTR_SLOTS] = {
+    [0]  = { "data",        4,  STREAM_ATTR_DATA },
+    [1]  = { "frameLength", 11, STREAM_ATTR_FRAME_LENGTH },
+    [2]  = { "layout",      6,  STREAM_ATTR_LAYOUT },
+    [3]  = { "method",      6,  STREAM_ATTR_METHOD },
+    [5]  = { "sampleType",  10, STREAM_ATTR_SAMPLE_TYPE },
+    [6]  = { "dimensions",  10, STREAM_ATTR_DIMENSIONS },
+    [7]  = { "frameRate",   9,  STREAM_ATTR_FRAME_RATE },
+    [11] = { "clientID",    8,  STREAM_ATTR_CLIENT_ID }
+};
+
+// The attributes kept in the stream hash, as a dirty mask
+#define ATTR_FIELDS ((1u << STREAM_ATTR_FRAME_LENGTH) | \
+                     (1u << STREAM_ATTR_FRAME_RATE) | \
+                     (1u << STREAM_ATTR_DIMENSIONS) | \
+                     (1u << STREAM_ATTR_SAMPLE_TYPE) | \
+                     (1u << STREAM_ATTR_LAYOUT))
+
+// The attributes that make up the frame size
+#define ATTR_FRAME ((1u << STREAM_ATTR_FRAME_LENGTH) | \
+                    (1u << STREAM_ATTR_DIMENSIONS) | \
+                    (1u << STREAM_ATTR_SAMPLE_TYPE))
+
+/*
+ * Every ring slot starts with its ring, so that a frame acquired before a
+ * resize finds its way back
+ * Slots are padded to SLOT_ALIGN, enough for the 64-bit fields of the header
+ * and the widest sample type
+ */
+
+#define SLOT_ALIGN 8
+#define SLOT_ROUND(n) (((n) + SLOT_ALIGN - 1) & ~((size_t) SLOT_ALIGN - 1))
+#define SLOT_OWNER SLOT_ROUND(sizeof(Stream_ring_t*))
+
+/*
+ * Commands sent over and over, parsed once on first use
+ */
+
+static redisCommandTemplate *feedCommand = NULL;
+
+static redisCommandTemplate *hmsetCommand = NULL;
+
+/*
+ * What _onCreatedMany needs to hand the streams back
+ */
+
+typedef struct Stream_batch_s {
+    Stream_t **streams;
+    int count;
+    Stream_batch_f callback;
+    void *priv;
+} Stream_batch_t;
+
+/*
+ * Update script, HMSET of KEYS[1] with ARGV[2..] and PUBLISH of ARGV[1]
+ * on KEYS[2]
+ */
+
+#define UPDATE_SCRIPT \
+    "if #ARGV > 1 then redis.call('HMSET', KEYS[1], unpack(ARGV, 2)) end " \
+    "return redis.call('PUBLISH', KEYS[2], ARGV[1])"
+
+typedef struct Stream_script_s {
+    bool enabled;
+    bool loading;              // SCRIPT LOAD in flight
+    char sha[41];              // Empty until loaded
+} Stream_script_t;
+
+static Stream_script_t script = { false, false, "" };
+
+/*
+ * An update sent as EVALSHA, with what it takes to send it again after a
+ * NOSCRIPT
+ * By then a newer update may be on the wire, so what goes out again are the
+ * fields, with whatever values they have at that point
+ */
+
+#define EVAL_ARGS (6 + 2 * STREAM_ATTR_COUNT)
+
+typedef struct Stream_eval_s {
+    Stream_t *stream;
+    uint32_t fields;           // Dirty mask of the update
+    char channel[1];           // "stream:<id>:feed"
+} Stream_eval_t;
+
+/*
+ * Routing tables, one per subscribe context
+ */
+
+static Stream_router_t *routers = NULL;
+
+
 /********************
  ** IMPLEMENTATION **
  ********************/
@@ -31,43 +218,75 @@ Stream_t* Stream_create (redisAsyncContext *c,
                          void (*callback)(Stream_t *))
 {
     Stream_t *s;
-    char *message;
+    Stream_router_t *router;
 
-    s = (Stream_t*) malloc(sizeof(Stream_t));
+    s = _alloc(c, id);
     if (s == NULL) return NULL;
 
-    s->frameLength = 1;
-    s->frameRate = 1;
-    s->dimensions = 1;
-    s->id = strdup(id);
-    s->redisContext = c;
     s->onCreated = callback;
-    s->onUpdated = NULL;
-    s->onPolled = NULL;
-    s->interval.tv_sec = 1;
-    s->interval.tv_usec = 0;
-    s->priv = NULL;
 
-    redisAsyncCommand(c, _onFreeMe, NULL, "MULTI");
-    redisAsyncCommand(c, _onFreeMe, NULL, "SADD stream %s", s->id);
-    redisAsyncCommand(c, _onFreeMe, NULL,
-        "HMSET stream:%s frameLength %d frameRate %d dimensions %d",
-        s->id, s->frameLength, s->frameRate, s->dimensions
-    );
-    message = _super_print("{"
-        "\"frameLength\": %d,"
-        "\"frameRate\": %d,"
-        "\"dimensions\": %d"
-    "}", s->frameLength, s->frameRate, s->dimensions);
-    Stream_publishEvent(s, "create", message);
-    free(message);
+    if (_register(c, &s, 1) != 0) {
+        _free(s);
+        return NULL;
+    }
     redisAsyncCommand(c, _onCreated, s, "EXEC");
 
-    redisAsyncCommand(subs, _onMessage, s, "SUBSCRIBE stream:%s:feed", s->id);
+    // The first stream of a context subscribes for all of them
+    router = _router_get(subs);
+    if (router == NULL || _router_add(router, s) != 0) {
+        Log_warn("Could not route the feed of %s", s->id);
+    }
+
     return s;
 }
 
 
+int Stream_createMany (redisAsyncContext *c,
+                       redisAsyncContext *subs,
+                       char **ids,
+                       int count,
+                       Stream_t **streams,
+                       Stream_batch_f callback,
+                       void *priv)
+{
+    Stream_batch_t *batch;
+    Stream_router_t *router;
+    int i;
+
+    if (count <= 0) return 1;
+
+    batch = (Stream_batch_t*) malloc(sizeof(Stream_batch_t));
+    if (batch == NULL) return 1;
+
+    // Nothing goes out unless every stream could be allocated
+    for (i = 0; i < count; i++) {
+        streams[i] = _alloc(c, ids[i]);
+        if (streams[i] == NULL) break;
+    }
+
+    if (i < count || _register(c, streams, count) != 0) {
+        while (i-- > 0) _free(streams[i]);
+        free(batch);
+        return 1;
+    }
+
+    batch->streams = streams;
+    batch->count = count;
+    batch->callback = callback;
+    batch->priv = priv;
+    redisAsyncCommand(c, _onCreatedMany, batch, "EXEC");
+
+    router = _router_get(subs);
+    for (i = 0; i < count; i++) {
+        if (router == NULL || _router_add(router, streams[i]) != 0) {
+            Log_warn("Could not route the feed of %s", streams[i]->id);
+        }
+    }
+
+    return 0;
+}
+
+
 /*
  * Main methods
  */
@@ -76,30 +295,13 @@ int Stream_update (Stream_t *s,
                    char *field,
                    int value)
 {
-    char *message;
-
-    if (strcmp(field, "frameLength") == 0) {
-        s->frameLength = value;
-    } else if (strcmp(field, "frameRate") == 0) {
-        s->frameRate = value;
-        double interval = 1.0 / value;
-        time_t sec = (time_t) floor(interval);
-        suseconds_t usec = (suseconds_t) floor((interval-sec) * 1e6);
-        s->interval.tv_sec = sec;
-        s->interval.tv_usec = usec;
-    } else if (strcmp(field, "dimensions") == 0) {
-        s->dimensions = value;
-    } else return 1;
-
-    redisAsyncCommand(s->redisContext, _onFreeMe, NULL,
-        "HSET stream:%s %s %d",
-        s->id, field, value
-    );
+    Stream_attr_t attr = Stream_lookupAttr(field, strlen(field));
 
-    message = _super_print("{\"%s\":%d}", field, value);
-    Stream_publishEvent(s, "update", message);
-    free(message);
+    if (_setAttr(s, attr, value) != 0) {
+        return 1;
+    }
 
+    _markDirty(s, 1u << attr);
     return 0;
 }
 
@@ -108,27 +310,150 @@ int Stream_sendFrame (Stream_t *s,
                       char *data,
                       size_t length)
 {
-    redisAsyncCommand(s->redisContext, _onFreeMe, NULL,
-        "PUBLISH stream:%s:pipe %b",
-        s->id, data, length
-    );
-    free(data);
+    if (Stream_sendFrameNoCopy(s, data, length, _onSent, NULL) != 0) {
+        free(data);
+        return 1;
+    }
 
     return 0;
 }
 
 
-int Stream_startPolling (Stream_t *s)
+int Stream_sendFrameNoCopy (Stream_t *s,
+                            char *data,
+                            size_t length,
+                            Stream_release_f release,
+                            void *priv)
+{
+    // The header is copied as the start of the message, the frame is not
+    Stream_held_t frame;
+
+    frame.data = data;
+    frame.length = length;
+    frame.inSlot = false;
+    frame.release = release;
+    frame.priv = priv;
+    _fillHeader(s, &(frame.header), length);
+
+    return _offer(s, &frame);
+}
+
+
+char* Stream_acquireFrame (Stream_t *s)
+{
+    Stream_ring_t *ring;
+    char *frame;
+
+    // The ring is dropped whenever the frame size changes
+    if (s->ring == NULL) {
+        s->ring = _ring_create(STREAM_FRAME_SLOTS,
+                               sizeof(Stream_header_t) + Stream_frameSize(s));
+        if (s->ring == NULL) return NULL;
+    }
+
+    ring = s->ring;
+    if (ring->busy[ring->next]) return NULL;
+
+    frame = ring->data + ring->next * ring->slotSize + SLOT_OWNER
+                       + sizeof(Stream_header_t);
+    ring->busy[ring->next] = 1;
+    ring->next = (ring->next + 1) % ring->slots;
+    ring->refs++;
+
+    return frame;
+}
+
+
+int Stream_commitFrame (Stream_t *s,
+                        char *frame)
+{
+    Stream_ring_t *ring;
+    char *slot = frame - sizeof(Stream_header_t);
+    Stream_held_t held;
+
+    memcpy(&ring, slot - SLOT_OWNER, sizeof(ring));
+
+    // Frames acquired before a resize are the wrong size, only the ring
+    // they came from gets them back
+    if (ring != s->ring) {
+        _ring_release(ring, slot);
+        s->stats.dropped++;
+        return 1;
+    }
+
+    // The header sits right before the frame, so the slot goes out as is
+    held.data = slot;
+    held.length = ring->length;
+    held.inSlot = true;
+    held.release = _onSlotSent;
+    held.priv = ring;
+    _fillHeader(s, (Stream_header_t*) slot,
+                held.length - sizeof(Stream_header_t));
+
+    if (_offer(s, &held) != 0) {
+        _ring_release(ring, slot);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int Stream_setPolicy (Stream_t *s,
+                      Stream_policy_t policy)
 {
-    event_set(&(s->timer), -1, EV_TIMEOUT , _onTimeout, s);
-    event_add(&(s->timer), &(s->interval));
+    // Whatever can't go out now was held under other rules
+    Stream_flush(s);
+    while (s->backlogCount > 0) {
+        _drop(_backlog_shift(s));
+        s->stats.dropped++;
+    }
+
+    s->policy = policy;
     return 0;
 }
 
 
+int Stream_flush (Stream_t *s)
+{
+    Stream_held_t *frame;
+
+    while (s->backlogCount > 0 && !redisAsyncIsCongested(s->redisContext)) {
+        frame = _backlog_shift(s);
+        if (_publish(s, frame) != 0) {
+            _drop(frame);
+            s->stats.dropped++;
+        }
+    }
+
+    return s->backlogCount;
+}
+
+
+int Stream_startPolling (Stream_t *s)
+{
+    if (s->ticker.group != NULL) return 0;
+    return Ticker_add(&(s->ticker), s->frameRate, s->tickPolicy, _onTick, s);
+}
+
+
 int Stream_stopPolling (Stream_t *s)
 {
-    event_del(&(s->timer));
+    Ticker_remove(&(s->ticker));
+    return 0;
+}
+
+
+int Stream_setTickPolicy (Stream_t *s,
+                          Ticker_policy_t policy)
+{
+    s->tickPolicy = policy;
+
+    if (s->ticker.group != NULL && s->ticker.group->policy != policy) {
+        Ticker_remove(&(s->ticker));
+        return Ticker_add(&(s->ticker), s->frameRate, policy, _onTick, s);
+    }
+
     return 0;
 }
 
@@ -137,26 +462,81 @@ int Stream_stopPolling (Stream_t *s)
  * Helpers
  */
 
+int Stream_useScripts (redisAsyncContext *c,
+                       bool enable)
+{
+    script.enabled = enable;
+
+    if (enable && script.sha[0] == '\0' && !script.loading) {
+        script.loading = true;
+        redisAsyncCommand(c, _onScriptLoaded, NULL,
+                          "SCRIPT LOAD %s", UPDATE_SCRIPT);
+    }
+
+    return 0;
+}
+
+
 int Stream_publishEvent (Stream_t *s,
                          char* method,
                          char* data)
 {
-    char *message;
-    message = _super_print("{"
-        "\"clientID\": \""CLIENT_ID"\","
-        "\"method\": \"%s\","
-        "\"data\": %s"
-    "}"
-    , method, data);
-
-    redisAsyncCommand(s->redisContext, _onFreeMe, NULL,
-        "PUBLISH stream:%s:feed %s",
-        s->id, message
-    );
+    json_writer *w;
 
-    if (message) free(message);
+    w = _eventBegin(s, method);
+    json_write_raw(w, data, strlen(data));
 
-    return 0;
+    return _eventSend(s, w);
+}
+
+
+Stream_attr_t Stream_lookupAttr (const char *name,
+                                 size_t len)
+{
+    const Stream_attr_entry_t *e;
+    unsigned char first, last;
+
+    if (len == 0) return STREAM_ATTR_UNKNOWN;
+
+    first = (unsigned char) name[0];
+    last = (unsigned char) name[len - 1];
+    e = &attrs[(len + first + (last << 3)) & (ATTR_SLOTS - 1)];
+
+    if (e->name == NULL || e->len != len ||
+        memcmp(e->name, name, len) != 0) {
+        return STREAM_ATTR_UNKNOWN;
+    }
+
+    return e->attr;
+}
+
+
+int Stream_scanFeed (const char *str,
+                     size_t len,
+                     Stream_feed_t *feed)
+{
+    json_sax_handler handler;
+    char error[128];
+
+    memset(feed, 0, sizeof(Stream_feed_t));
+    memset(&handler, 0, sizeof(handler));
+    handler.object_start = _onFeedObject;
+    handler.object_end = _onFeedObjectEnd;
+    handler.key = _onFeedKey;
+    handler.value = _onFeedValue;
+    handler.user_data = feed;
+
+    switch (json_sax_parse(&handler, str, len, error)) {
+        case json_sax_error:
+            Log_warn("Malformed feed message: %s", error);
+            return 1;
+        case json_sax_stopped:
+            return 1;
+        default:
+            break;
+    }
+
+    return feed->updating && !feed->echo ? 0 : 1;
 }
 
 
@@ -176,103 +556,133 @@ void _onCreated (redisAsyncContext *c,
 }
 
 
+void _onCreatedMany (redisAsyncContext *c,
+                     void *r,
+                     void *priv)
+{
+    Stream_batch_t *batch = (Stream_batch_t*) priv;
+
+    if (batch->callback != NULL) {
+        batch->callback(batch->streams, batch->count, batch->priv);
+    }
+
+    free(batch);
+}
+
+
 void _onMessage (redisAsyncContext *c,
                  void *r,
                  void *priv)
 {
-    Stream_t *s  = (Stream_t*) priv;
+    Stream_router_t *router = (Stream_router_t*) priv;
     redisReply *reply = (redisReply*) r;
-    int i = 0;
-    json_value *data = NULL;
-    bool updating = false;
-    bool valid = true;
+    redisReply *channel;
+    Stream_t *s;
 
     if (reply == NULL) return;
 
-    printf("Hey, we got a message!\n");
+    if (reply->type != REDIS_REPLY_ARRAY ||
+        reply->elements < 3 ||
+        reply->element[0]->type != REDIS_REPLY_STRING) {
+        Log_warn("Unexpected reply on the feeds");
+        return;
+    }
 
-    if (reply->type == REDIS_REPLY_ARRAY &&
-        reply->elements == 3 &&
-        strcmp(reply->element[0]->str, "subscribe") != 0 &&
-        reply->element[2]->type == REDIS_REPLY_STRING) {
+    if (strcmp(reply->element[0]->str, "psubscribe") == 0) {
+        Log_debug("Subscribed to the feeds");
+        return;
+    }
 
-            printf("Seems legit...\n");
+    // Messages are "pmessage", the pattern, "stream:<id>:feed" and the payload
+    channel = reply->element[2];
+    if (reply->elements != 4 || channel->type != REDIS_REPLY_STRING ||
+        channel->len < 12) {
+        Log_warn("Unexpected message on the feeds");
+        return;
+    }
 
-            json_value *root = json_parse(
-                reply->element[2]->str,
-                reply->element[2]->len
-            );
+    s = _router_find(router, channel->str + 7, channel->len - 12);
+    if (s == NULL) return;  // Somebody else's stream
 
-            if (root == NULL) {
-                printf("Oops! Malformed JSON sequence.\n");
-                json_value_free(root);
-                return;
-            }
+    _onFeed(s, reply->element[3]);
+}
 
-            for (i = 0; i < root->u.object.length; ++i) {
-                json_char *name = root->u.object.values[i].name;
-                json_value *value = root->u.object.values[i].value;
-                if (strcmp(name, CLIENT_ID) == 0) {
-                    printf("Ouch. It was mine.\n");
-                    valid = false;
-                    break;
-                } else if (strcmp(name, "data") == 0) {
-                    data = value;
-                } else if (strcmp(name, "method") == 0 &&
-                           strcmp(value->u.string.ptr, "update") == 0) {
-                    printf("And it's an update. Good.\n");
-                    updating = true;
-                }
-            }
 
-            if (valid && updating && data != NULL) {
-                printf("Cool! Let's decode it.\n");
-                for (i = 0; i < data->u.object.length; ++i) {
-                    json_char *name = data->u.object.values[i].name;
-                    json_value *value = data->u.object.values[i].value;
-
-                    if (strcmp(name, "frameLength") == 0) {
-                        s->frameLength = (int) value->u.integer;
-                        printf("Updated frameLength: %d\n", s->frameLength);
-                    } else if (strcmp(name, "frameRate") == 0) {
-                        int rate = (int) value->u.integer;
-                        double interval = 1.0 / rate;
-                        time_t sec = (time_t) floor(interval);
-                        suseconds_t usec = (suseconds_t) floor((interval-sec) * 1e6);
-                        s->frameRate = rate;
-                        s->interval.tv_sec = sec;
-                        s->interval.tv_usec = usec;
-                        printf("Updated frameRate: %d\n", s->frameRate);
-                    } else if (strcmp(name, "dimensions") == 0) {
-                        s->dimensions = (int) value->u.integer;
-                        printf("Updated dimensions: %d\n", s->dimensions);
-                    }
-
-                    if (s->onUpdated != NULL) {
-                        s->onUpdated(s);
-                    }
-                }
-            }
+void _onScriptLoaded (redisAsyncContext *c,
+                      void *r,
+                      void *priv)
+{
+    redisReply *reply = (redisReply*) r;
 
-            json_value_free(root);
+    script.loading = false;
 
-    } else {
+    if (reply == NULL || reply->type != REDIS_REPLY_STRING ||
+        reply->len != 40) {
+        Log_warn("Could not load the update script");
+        return;
+    }
 
-        printf("Ouch. Reply not valid:\n");
-        int i;
-        for (i = 0; i < reply->elements; i++) {
-            printf("    %s\n", reply->element[i]->str);
-        }
+    memcpy(script.sha, reply->str, 41);
+    Log_debug("Loaded the update script as %s", script.sha);
+}
+
+
+void _onEvalReply (redisAsyncContext *c,
+                   void *r,
+                   void *priv)
+{
+    Stream_eval_t *e = (Stream_eval_t*) priv;
+    redisReply *reply = (redisReply*) r;
 
+    if (reply != NULL && reply->type == REDIS_REPLY_ERROR) {
+        if (strncmp(reply->str, "NOSCRIPT", 8) == 0) {
+            // The server restarted or flushed its scripts, the next flush
+            // sends the whole of it along with the latest values
+            script.sha[0] = '\0';
+            Stream_useScripts(c, script.enabled);
+            _markDirty(e->stream, e->fields);
+        } else {
+            Log_warn("Update script failed: %s", reply->str);
+        }
     }
+
+    free(e);
 }
 
 
-void _onFreeMe (redisAsyncContext *c,
-                void *r,
-                void *priv)
+void _onFlush (int fd,
+               short event,
+               void *priv)
+{
+    _flushAttrs((Stream_t*) priv);
+}
+
+
+void _onFeed (Stream_t *s,
+              redisReply *payload)
 {
-    if (priv) free(priv);
+    Stream_feed_t feed;
+
+    if (payload->type != REDIS_REPLY_STRING) {
+        Log_warn("Unexpected message on the feed of %s", s->id);
+        return;
+    }
+
+    if (Stream_scanFeed(payload->str, payload->len, &feed) != 0) return;
+    if (feed.pending == 0) return;
+
+    // The message is taken as a whole, or not at all
+    if (_setAttrs(s, feed.pending, feed.values) != 0) {
+        Log_warn("Ignored an update of %s: %.*s", s->id,
+                 (int) payload->len, payload->str);
+        return;
+    }
+
+    Log_debug("Updated attributes %#x of %s", feed.pending, s->id);
+
+    if (s->onUpdated != NULL) {
+        s->onUpdated(s);
+    }
 }
 
 
@@ -290,23 +700,841 @@ void _onFreeUs (redisAsyncContext *c,
 }
 
 
-void _onTimeout (int fd,
-                 short ev,
-                 void* priv)
+void _onSent (void *data,
+              void *priv)
+{
+    free(data);
+}
+
+
+void _onSlotSent (void *data,
+                  void *priv)
+{
+    _ring_release((Stream_ring_t*) priv, (char*) data);
+}
+
+
+void _onTick (void *priv)
 {
-    // TODO: check if onPolled takes longer than the interval
     Stream_t *s = (Stream_t*) priv;
 
-    event_add(&(s->timer), &(s->interval));
+    Stream_flush(s);
+
+    // The producer waits for the queue to drain instead of losing frames
+    if (s->policy == STREAM_BLOCK && redisAsyncIsCongested(s->redisContext)) {
+        s->stats.blocked++;
+        return;
+    }
+
     if (s->onPolled != NULL) {
         s->onPolled(s);
     }
 }
 
 
-/*
- * Utils
- */
+int _onFeedObject (void *priv,
+                   unsigned int depth)
+{
+    Stream_feed_t *feed = (Stream_feed_t*) priv;
+
+    if (depth == 1 && feed->top == STREAM_ATTR_DATA) {
+        feed->inData = true;
+    }
+    return 0;
+}
+
+
+int _onFeedObjectEnd (void *priv,
+                      unsigned int depth)
+{
+    Stream_feed_t *feed = (Stream_feed_t*) priv;
+
+    if (depth == 1) {
+        feed->inData = false;
+    }
+    return 0;
+}
+
+
+int _onFeedKey (void *priv,
+                unsigned int depth,
+                const char *key,
+                unsigned int len,
+                int escaped)
+{
+    Stream_feed_t *feed = (Stream_feed_t*) priv;
+    Stream_attr_t attr = escaped ? STREAM_ATTR_UNKNOWN
+                                 : Stream_lookupAttr(key, len);
+
+    if (depth == 1) {
+        feed->top = attr;
+    } else if (depth == 2 && feed->inData) {
+        feed->key = attr;
+    }
+    return 0;
+}
+
+
+// Nonzero stops the scan, no need to read further than the clientID
+// A value that doesn't fit an int stops it as well, the whole message is
+// turned down rather than applied truncated
+int _onFeedValue (void *priv,
+                  unsigned int depth,
+                  const json_sax_value *value)
+{
+    Stream_feed_t *feed = (Stream_feed_t*) priv;
+    const char *str = value->u.string.ptr;
+    unsigned int len = value->u.string.length;
+
+    if (depth == 1 && value->type == json_string) {
+        switch (feed->top) {
+            case STREAM_ATTR_CLIENT_ID:
+                feed->echo = len == sizeof(CLIENT_ID) - 1 &&
+                             memcmp(str, CLIENT_ID, len) == 0;
+                return feed->echo;
+            case STREAM_ATTR_METHOD:
+                feed->updating = len == 6 && memcmp(str, "update", 6) == 0;
+                return !feed->updating;
+            default:
+                break;
+        }
+    } else if (depth == 2 && feed->inData &&
+               feed->key > STREAM_ATTR_DATA &&
+               value->type == json_integer) {
+        if (value->u.integer < INT_MIN || value->u.integer > INT_MAX) {
+            Log_warn("Attribute %d out of range: %lld", feed->key,
+                     (long long) value->u.integer);
+            return 1;
+        }
+        feed->values[feed->key] = (int) value->u.integer;
+        feed->pending |= 1u << feed->key;
+    }
+    return 0;
+}
+
+
+/*
+ * Scheduling
+ */
+
+void _setRate (Stream_t *s,
+               int rate)
+{
+    uint64_t period = 1000000000ULL / rate;
+
+    s->frameRate = rate;
+    s->interval.tv_sec = period / 1000000000ULL;
+    s->interval.tv_usec = (period % 1000000000ULL) / 1000;
+
+    // Move over to the group at the new rate
+    if (s->ticker.group != NULL && s->ticker.group->rate != rate) {
+        Ticker_remove(&(s->ticker));
+        Ticker_add(&(s->ticker), rate, s->tickPolicy, _onTick, s);
+    }
+}
+
+
+/*
+ * Attributes
+ */
+
+// A single attribute goes through the same checks as a whole message
+int _setAttr (Stream_t *s,
+              Stream_attr_t attr,
+              int value)
+{
+    int values[STREAM_ATTR_COUNT];
+
+    values[attr] = value;
+    return _setAttrs(s, 1u << attr, values);
+}
+
+
+// Values come from remote feeds, anything that can't describe a frame is
+// turned down before it reaches the stream
+// Every value is checked along with the others in mask, so that they are
+// all applied or none is, whatever order they came in
+int _setAttrs (Stream_t *s,
+               uint32_t mask,
+               const int *values)
+{
+    int frameLength = s->frameLength;
+    int dimensions = s->dimensions;
+    int sampleType = s->sampleType;
+    int value;
+
+    if (mask == 0 || (mask & ~ATTR_FIELDS) != 0) return 1;
+
+    if (mask & (1u << STREAM_ATTR_FRAME_LENGTH)) {
+        frameLength = values[STREAM_ATTR_FRAME_LENGTH];
+    }
+
+    if (mask & (1u << STREAM_ATTR_FRAME_RATE) &&
+        values[STREAM_ATTR_FRAME_RATE] <= 0) {
+        return 1;
+    }
+
+    if (mask & (1u << STREAM_ATTR_DIMENSIONS)) {
+        // The frame header only has 16 bits for it
+        value = values[STREAM_ATTR_DIMENSIONS];
+        if (value > UINT16_MAX) return 1;
+        dimensions = value;
+    }
+
+    if (mask & (1u << STREAM_ATTR_SAMPLE_TYPE)) {
+        value = values[STREAM_ATTR_SAMPLE_TYPE];
+        if (value < STREAM_U8 || value > STREAM_F32) return 1;
+        sampleType = value;
+    }
+
+    if (mask & (1u << STREAM_ATTR_LAYOUT)) {
+        value = values[STREAM_ATTR_LAYOUT];
+        if (value != STREAM_INTERLEAVED && value != STREAM_PLANAR) return 1;
+    }
+
+    // Divided rather than multiplied, so the check itself can't overflow
+    if ((mask & ATTR_FRAME) &&
+        (frameLength <= 0 || dimensions <= 0 ||
+         (size_t) frameLength > STREAM_MAX_FRAME
+                                / Stream_sampleSize(sampleType)
+                                / dimensions)) {
+        return 1;
+    }
+
+    // Everything checks out, only now does the stream change
+    if (mask & (1u << STREAM_ATTR_FRAME_RATE)) {
+        _setRate(s, values[STREAM_ATTR_FRAME_RATE]);
+    }
+
+    if (mask & (1u << STREAM_ATTR_LAYOUT)) {
+        s->layout = values[STREAM_ATTR_LAYOUT];
+    }
+
+    if (mask & ATTR_FRAME) {
+        s->frameLength = frameLength;
+        s->dimensions = dimensions;
+        s->sampleType = sampleType;
+
+        // The frame size changed, the ring can't hold it anymore
+        _ring_unref(s->ring);
+        s->ring = NULL;
+    }
+
+    return 0;
+}
+
+
+int _getAttr (Stream_t *s,
+              Stream_attr_t attr)
+{
+    switch (attr) {
+        case STREAM_ATTR_FRAME_LENGTH: return s->frameLength;
+        case STREAM_ATTR_FRAME_RATE:   return s->frameRate;
+        case STREAM_ATTR_DIMENSIONS:   return s->dimensions;
+        case STREAM_ATTR_SAMPLE_TYPE:  return s->sampleType;
+        case STREAM_ATTR_LAYOUT:       return s->layout;
+        default:                       return 0;
+    }
+}
+
+
+const char* _attrName (Stream_attr_t attr)
+{
+    int i;
+
+    for (i = 0; i < ATTR_SLOTS; i++) {
+        if (attrs[i].name != NULL && attrs[i].attr == attr) {
+            return attrs[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+
+// The first change of this iteration schedules the flush
+void _markDirty (Stream_t *s,
+                 uint32_t fields)
+{
+    struct timeval now = { 0, 0 };
+
+    if (s->dirty == 0) {
+        evtimer_add(&(s->flush), &now);
+    }
+    s->dirty |= fields;
+}
+
+
+// One HMSET and one update event for everything changed since the last one
+void _flushAttrs (Stream_t *s)
+{
+    const char *argv[2 + 2 * STREAM_ATTR_COUNT];
+    size_t argvlen[2 + 2 * STREAM_ATTR_COUNT];
+    char values[STREAM_ATTR_COUNT][12];
+    json_writer *w;
+    uint32_t fields = s->dirty;
+    int argc = 2;
+    int attr;
+
+    if (fields == 0) return;
+
+    // The key is "stream:<id>", the front of the pipe channel
+    argv[0] = "HMSET";
+    argvlen[0] = 5;
+    argv[1] = s->pipe;
+    argvlen[1] = strlen(s->pipe) - 5;
+
+    for (attr = 0; attr < STREAM_ATTR_COUNT; attr++) {
+        if (!(fields & (1u << attr))) continue;
+
+        argv[argc] = _attrName((Stream_attr_t) attr);
+        argvlen[argc] = strlen(argv[argc]);
+        argc++;
+
+        argvlen[argc] = snprintf(values[attr], sizeof(values[attr]), "%d",
+                                 _getAttr(s, (Stream_attr_t) attr));
+        argv[argc] = values[attr];
+        argc++;
+    }
+
+    w = _eventBegin(s, "update");
+    _writeAttrs(w, s, fields);
+    s->dirty = 0;
+
+    if (script.enabled) {
+        json_write_end(w);
+        if (!w->error) {
+            _evalAttrs(s, fields, argc, argv, argvlen, w->buffer, w->length);
+        }
+    } else {
+        redisAsyncCommandArgv(s->redisContext, NULL, NULL,
+                              argc, argv, argvlen);
+        _eventSend(s, w);
+    }
+}
+
+
+// Same as HMSET argv followed by the update event, in a single EVALSHA
+void _evalAttrs (Stream_t *s,
+                 uint32_t fields,
+                 int argc,
+                 const char **argv,
+                 const size_t *argvlen,
+                 const char *message,
+                 size_t length)
+{
+    Stream_eval_t *e;
+    const char *args[EVAL_ARGS];
+    size_t lens[EVAL_ARGS];
+    size_t idLength = strlen(s->id);
+    int i;
+
+    e = (Stream_eval_t*) malloc(sizeof(Stream_eval_t) + idLength + 12);
+    if (e == NULL) return;
+
+    e->stream = s;
+    e->fields = fields;
+    memcpy(e->channel, "stream:", 7);
+    memcpy(e->channel + 7, s->id, idLength);
+    memcpy(e->channel + 7 + idLength, ":feed", 6);
+
+    // Keys, then the event, then the field/value pairs
+    // Until the script is loaded, the server gets the whole of it
+    if (script.sha[0] == '\0') {
+        args[0] = "EVAL";
+        args[1] = UPDATE_SCRIPT;
+    } else {
+        args[0] = "EVALSHA";
+        args[1] = script.sha;
+    }
+    args[2] = "2";
+    args[3] = argv[1];
+    args[4] = e->channel;
+    args[5] = message;
+    lens[0] = strlen(args[0]);
+    lens[1] = strlen(args[1]);
+    lens[2] = 1;
+    lens[3] = argvlen[1];
+    lens[4] = idLength + 12;
+    lens[5] = length;
+    for (i = 2; i < argc; i++) {
+        args[i + 4] = argv[i];
+        lens[i + 4] = argvlen[i];
+    }
+
+    redisAsyncCommandArgv(s->redisContext, _onEvalReply, e,
+                          argc + 4, args, lens);
+}
+
+
+/*
+ * Events
+ */
+
+// Starts the envelope of an event in the writer of s, the next value
+// written is its data
+json_writer* _eventBegin (Stream_t *s,
+                          const char *method)
+{
+    json_writer *w = &(s->events);
+
+    json_writer_reset(w);
+    json_write_object(w);
+    json_write_key(w, "clientID", 8);
+    json_write_string(w, CLIENT_ID, sizeof(CLIENT_ID) - 1);
+    json_write_key(w, "method", 6);
+    json_write_string(w, method, strlen(method));
+    json_write_key(w, "data", 4);
+
+    return w;
+}
+
+
+// Closes the envelope and publishes it on the feed of s
+int _eventSend (Stream_t *s,
+                json_writer *w)
+{
+    redisCommandTemplate *t;
+
+    json_write_end(w);
+    if (w->error) return 1;
+
+    t = _template(&feedCommand, "PUBLISH stream:%s:feed %b");
+    if (t == NULL) return 1;
+
+    redisAsyncCommandTemplate(s->redisContext, NULL, NULL, t,
+        s->id, w->buffer, w->length
+    );
+
+    return 0;
+}
+
+
+// An object of the attributes in mask, by name
+void _writeAttrs (json_writer *w,
+                  Stream_t *s,
+                  uint32_t mask)
+{
+    const char *name;
+    int attr;
+
+    json_write_object(w);
+
+    for (attr = 0; attr < STREAM_ATTR_COUNT; attr++) {
+        if (!(mask & (1u << attr))) continue;
+
+        name = _attrName((Stream_attr_t) attr);
+        json_write_key(w, name, strlen(name));
+        json_write_integer(w, _getAttr(s, (Stream_attr_t) attr));
+    }
+
+    json_write_end(w);
+}
+
+
+/*
+ * Frame ring
+ */
+
+Stream_ring_t* _ring_create (int slots,
+                             size_t length)
+{
+    Stream_ring_t *ring;
+    int i;
+
+    ring = (Stream_ring_t*) malloc(sizeof(Stream_ring_t));
+    if (ring == NULL) return NULL;
+
+    ring->refs = 1;
+    ring->slots = slots;
+    ring->next = 0;
+    ring->length = length;
+    ring->slotSize = SLOT_ROUND(SLOT_OWNER + length);
+    ring->busy = (char*) calloc(slots, 1);
+    ring->data = (char*) malloc(slots * ring->slotSize);
+
+    if (ring->busy == NULL || ring->data == NULL) {
+        free(ring->busy);
+        free(ring->data);
+        free(ring);
+        return NULL;
+    }
+
+    for (i = 0; i < slots; i++) {
+        memcpy(ring->data + i * ring->slotSize, &ring, sizeof(ring));
+    }
+
+    return ring;
+}
+
+
+void _ring_unref (Stream_ring_t *ring)
+{
+    if (ring == NULL || --ring->refs > 0) return;
+
+    free(ring->busy);
+    free(ring->data);
+    free(ring);
+}
+
+
+void _ring_release (Stream_ring_t *ring,
+                    char *frame)
+{
+    ring->busy[(frame - ring->data) / ring->slotSize] = 0;
+    _ring_unref(ring);
+}
+
+
+/*
+ * Sending frames, and holding them back while congested
+ */
+
+int _offer (Stream_t *s,
+            Stream_held_t *frame)
+{
+    int room;
+
+    // Frames go out in order, nothing jumps ahead of the backlog
+    if (s->backlogCount > 0) Stream_flush(s);
+
+    if (s->backlogCount == 0 && (s->policy == STREAM_BLOCK ||
+                                 !redisAsyncIsCongested(s->redisContext))) {
+        return _publish(s, frame);
+    }
+
+    if (s->policy == STREAM_DROP_NEWEST) {
+        _drop(frame);
+        s->stats.dropped++;
+        return 0;
+    }
+
+    // Make room by letting go of the oldest held frame
+    room = s->policy == STREAM_COALESCE ? 1 : STREAM_BACKLOG;
+    if (s->backlogCount >= room) {
+        _drop(_backlog_shift(s));
+        if (s->policy == STREAM_COALESCE) s->stats.coalesced++;
+        else s->stats.dropped++;
+    }
+
+    s->backlog[(s->backlogFirst + s->backlogCount) % STREAM_BACKLOG] = *frame;
+    s->backlogCount++;
+    return 0;
+}
+
+
+int _publish (Stream_t *s,
+              Stream_held_t *frame)
+{
+    const char *argv[3] = { "PUBLISH", s->pipe, (const char*) &(frame->header) };
+    size_t argvlen[3] = { 7, strlen(s->pipe),
+                          frame->inSlot ? 0 : sizeof(Stream_header_t) };
+
+    // Nobody reads the reply, hiredis only counts it
+    if (redisAsyncCommandArgvNoCopy(s->redisContext, NULL, NULL,
+            3, argv, argvlen, frame->data, frame->length,
+            frame->release, frame->priv) != REDIS_OK) {
+        return 1;
+    }
+
+    s->stats.sent++;
+    return 0;
+}
+
+
+Stream_held_t* _backlog_shift (Stream_t *s)
+{
+    Stream_held_t *frame = &(s->backlog[s->backlogFirst]);
+
+    s->backlogFirst = (s->backlogFirst + 1) % STREAM_BACKLOG;
+    s->backlogCount--;
+    return frame;
+}
+
+
+void _drop (Stream_held_t *frame)
+{
+    if (frame->release != NULL) {
+        frame->release((void*) frame->data, frame->priv);
+    }
+}
+
+
+/*
+ * Frame header
+ */
+
+void _fillHeader (Stream_t *s,
+                  Stream_header_t *h,
+                  size_t length)
+{
+    h->magic = STREAM_FRAME_MAGIC;
+    h->version = STREAM_FRAME_VERSION;
+    h->sampleType = (uint8_t) s->sampleType;
+    h->layout = (uint8_t) s->layout;
+    h->idHash = htole32(s->idHash);
+    h->timestamp = htole64(_timestamp());
+    h->sequence = htole32(s->sequence++);
+    h->frameLength = htole32((uint32_t) s->frameLength);
+    h->dimensions = htole16((uint16_t) s->dimensions);
+    h->reserved = 0;
+    h->payloadLength = htole32((uint32_t) length);
+}
+
+
+// Microseconds since the epoch, read once from the wall clock and carried
+// on by the monotonic one, so frames never go back in time
+uint64_t _timestamp (void)
+{
+    static uint64_t epoch = 0;
+    struct timespec mono;
+    struct timeval wall;
+    uint64_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    now = (uint64_t) mono.tv_sec * 1000000 + mono.tv_nsec / 1000;
+
+    if (epoch == 0) {
+        gettimeofday(&wall, NULL);
+        epoch = (uint64_t) wall.tv_sec * 1000000 + wall.tv_usec - now;
+    }
+
+    return epoch + now;
+}
+
+
+// FNV-1a, cheap enough and stable across clients
+uint32_t _hash (const char *str,
+               size_t len)
+{
+    uint32_t h = 2166136261u;
+    while (len--) {
+        h ^= (unsigned char) *str++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/*
+ * Creation
+ */
+
+Stream_t* _alloc (redisAsyncContext *c,
+                  char *id)
+{
+    Stream_t *s;
+
+    s = (Stream_t*) malloc(sizeof(Stream_t));
+    if (s == NULL) return NULL;
+
+    s->frameLength = 1;
+    s->frameRate = 1;
+    s->dimensions = 1;
+    s->sampleType = STREAM_U8;
+    s->layout = STREAM_INTERLEAVED;
+    s->id = strdup(id);
+    s->idHash = _hash(id, strlen(id));
+    s->sequence = 0;
+    s->pipe = _super_print("stream:%s:pipe", id);
+    s->redisContext = c;
+    s->onCreated = NULL;
+    s->onUpdated = NULL;
+    s->onPolled = NULL;
+    s->interval.tv_sec = 1;
+    s->interval.tv_usec = 0;
+    memset(&(s->ticker), 0, sizeof(s->ticker));
+    s->tickPolicy = TICKER_CATCHUP;
+    s->ring = NULL;
+    s->policy = STREAM_DROP_OLDEST;
+    s->backlogFirst = 0;
+    s->backlogCount = 0;
+    memset(&(s->stats), 0, sizeof(s->stats));
+    s->route = NULL;
+    s->dirty = 0;
+    json_writer_init(&(s->events), 0);
+    evtimer_set(&(s->flush), _onFlush, s);
+    s->priv = NULL;
+
+    if (s->id == NULL || s->pipe == NULL) {
+        _free(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+
+void _free (Stream_t *s)
+{
+    json_writer_free(&(s->events));
+    free(s->id);
+    free(s->pipe);
+    free(s);
+}
+
+
+// Queues everything but the EXEC, replies are only counted until then
+int _register (redisAsyncContext *c,
+               Stream_t **streams,
+               int count)
+{
+    redisCommandTemplate *t;
+    const char **argv;
+    Stream_t *s;
+    json_writer *w;
+    int i;
+
+    argv = (const char**) malloc((count + 2) * sizeof(char*));
+    t = _template(&hmsetCommand,
+        "HMSET stream:%s frameLength %d frameRate %d dimensions %d "
+        "sampleType %d layout %d");
+    if (argv == NULL || t == NULL) {
+        free(argv);
+        return 1;
+    }
+
+    argv[0] = "SADD";
+    argv[1] = "stream";
+    for (i = 0; i < count; i++) {
+        argv[i + 2] = streams[i]->id;
+    }
+
+    redisAsyncCommand(c, NULL, NULL, "MULTI");
+    redisAsyncCommandArgv(c, NULL, NULL, count + 2, argv, NULL);
+    free(argv);
+
+    for (i = 0; i < count; i++) {
+        s = streams[i];
+        redisAsyncCommandTemplate(c, NULL, NULL, t,
+            s->id, s->frameLength, s->frameRate, s->dimensions,
+            s->sampleType, s->layout
+        );
+    }
+
+    // A single stream is announced on its own feed
+    if (count == 1) {
+        w = _eventBegin(streams[0], "create");
+        _writeAttrs(w, streams[0], ATTR_FIELDS);
+        _eventSend(streams[0], w);
+        return 0;
+    }
+
+    // A batch is announced once, every stream by ID, on the feed of the set
+    // The first stream lends its writer
+    w = _eventBegin(streams[0], "create");
+    json_write_object(w);
+    for (i = 0; i < count; i++) {
+        s = streams[i];
+        json_write_key(w, s->id, strlen(s->id));
+        _writeAttrs(w, s, ATTR_FIELDS);
+    }
+    json_write_end(w);
+    json_write_end(w);
+
+    if (!w->error) {
+        redisAsyncCommand(c, NULL, NULL, "PUBLISH stream:feed %b",
+                          w->buffer, w->length);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Feed routing
+ */
+
+Stream_router_t* _router_get (redisAsyncContext *subs)
+{
+    Stream_router_t *router;
+
+    for (router = routers; router != NULL; router = router->next) {
+        if (router->subs == subs) return router;
+    }
+
+    router = (Stream_router_t*) calloc(1, sizeof(Stream_router_t));
+    if (router == NULL) return NULL;
+
+    router->buckets = (Stream_t**) calloc(STREAM_ROUTER_MIN, sizeof(Stream_t*));
+    if (router->buckets == NULL) {
+        free(router);
+        return NULL;
+    }
+
+    router->subs = subs;
+    router->size = STREAM_ROUTER_MIN;
+    router->next = routers;
+    routers = router;
+
+    redisAsyncCommand(subs, _onMessage, router, "PSUBSCRIBE stream:*:feed");
+    return router;
+}
+
+
+int _router_add (Stream_router_t *router,
+                 Stream_t *s)
+{
+    Stream_t **buckets, *e, *next;
+    int size, i;
+
+    // Keep chains short, rehashing only relinks the streams
+    if (router->count >= router->size) {
+        size = router->size * 2;
+        buckets = (Stream_t**) calloc(size, sizeof(Stream_t*));
+        if (buckets == NULL) return 1;
+
+        for (i = 0; i < router->size; i++) {
+            for (e = router->buckets[i]; e != NULL; e = next) {
+                next = e->route;
+                e->route = buckets[e->idHash & (size - 1)];
+                buckets[e->idHash & (size - 1)] = e;
+            }
+        }
+
+        free(router->buckets);
+        router->buckets = buckets;
+        router->size = size;
+    }
+
+    i = s->idHash & (router->size - 1);
+    s->route = router->buckets[i];
+    router->buckets[i] = s;
+    router->count++;
+    return 0;
+}
+
+
+Stream_t* _router_find (Stream_router_t *router,
+                        const char *id,
+                        size_t len)
+{
+    uint32_t h = _hash(id, len);
+    Stream_t *s;
+
+    for (s = router->buckets[h & (router->size - 1)]; s != NULL; s = s->route) {
+        if (s->idHash == h && strncmp(s->id, id, len) == 0 &&
+            s->id[len] == '\0') {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Utils
+ */
+
+// Parses the format the first time, a failure is retried on the next call
+redisCommandTemplate* _template (redisCommandTemplate **t,
+                                const char *format)
+{
+    if (*t == NULL) *t = redisCommandTemplateCreate(format);
+    return *t;
+}
+
 
 // sprintf-like with dynamic allocation
 char* _super_print (const char *fmt, ...)
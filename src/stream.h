@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 #include <math.h>
 
 #include <event.h>
@@ -19,6 +20,9 @@
 
 #include "../lib/json.h"
 
+#include "ticker.h"
+#include "log.h"
+
 /*
  * Define some compile-time constants
  */
@@ -27,6 +31,153 @@
  #define CLIENT_ID "c_stream"     // Default feedback rejection ID
 #endif
 
+#ifndef STREAM_FRAME_SLOTS
+ #define STREAM_FRAME_SLOTS 8     // Frames that can be in flight per stream
+#endif
+
+#ifndef STREAM_BACKLOG
+ #define STREAM_BACKLOG 4         // Frames held per stream while congested
+#endif
+
+#ifndef STREAM_ROUTER_MIN
+ #define STREAM_ROUTER_MIN 64     // Buckets of a new routing table
+#endif
+
+#ifndef STREAM_MAX_FRAME
+ #define STREAM_MAX_FRAME (16 << 20) // Largest frame accepted, in bytes
+#endif
+
+#define STREAM_FRAME_MAGIC 0xF5  // First byte of every frame header
+#define STREAM_FRAME_VERSION 1
+
+/*
+ * Sample types and channel layouts a frame can carry
+ */
+
+typedef enum {
+    STREAM_U8,
+    STREAM_I16,
+    STREAM_F32
+} Stream_sample_t;
+
+typedef enum {
+    STREAM_INTERLEAVED,        // s0c0 s0c1 ... s1c0 s1c1 ...
+    STREAM_PLANAR              // s0c0 s1c0 ... s0c1 s1c1 ...
+} Stream_layout_t;
+
+/*
+ * What a stream does with frames while its Redis context is congested
+ * See redisAsyncSetWatermarks, nothing is held back without watermarks
+ */
+
+typedef enum {
+    STREAM_DROP_OLDEST,        // Hold the last STREAM_BACKLOG frames
+    STREAM_DROP_NEWEST,        // Throw new frames away
+    STREAM_COALESCE,           // Hold the last frame only
+    STREAM_BLOCK               // Stop polling the producer, send everything
+} Stream_policy_t;
+
+/*
+ * Names that can show up in feed messages
+ * Control keys first, then the attributes a Stream can update
+ */
+
+typedef enum {
+    STREAM_ATTR_UNKNOWN,
+    STREAM_ATTR_CLIENT_ID,
+    STREAM_ATTR_METHOD,
+    STREAM_ATTR_DATA,
+    STREAM_ATTR_FRAME_LENGTH,
+    STREAM_ATTR_FRAME_RATE,
+    STREAM_ATTR_DIMENSIONS,
+    STREAM_ATTR_SAMPLE_TYPE,
+    STREAM_ATTR_LAYOUT,
+    STREAM_ATTR_COUNT
+} Stream_attr_t;
+
+typedef struct Stream_attr_entry_s {
+    const char *name;
+    size_t len;
+    Stream_attr_t attr;
+} Stream_attr_entry_t;
+
+/*
+ * This is what a feed message boils down to
+ * Filled by Stream_scanFeed in a single pass over the raw message
+ */
+
+typedef struct Stream_feed_s {
+    Stream_attr_t top;                 // Last key seen in the root object
+    Stream_attr_t key;                 // Last key seen in the data object
+    bool inData;
+    bool updating;                     // The method is "update"
+    bool echo;                         // The clientID is ours
+    uint32_t pending;                  // Bit per attribute found in data
+    int values[STREAM_ATTR_COUNT];
+} Stream_feed_t;
+
+/*
+ * This is the binary header that precedes every frame on the pipe channel
+ * Every field is little-endian, the struct is 32 bytes without padding
+ * Consumers can spot dropped frames with the sequence number
+ */
+
+typedef struct Stream_header_s {
+    uint8_t magic;             // STREAM_FRAME_MAGIC
+    uint8_t version;           // STREAM_FRAME_VERSION
+    uint8_t sampleType;        // Stream_sample_t
+    uint8_t layout;            // Stream_layout_t
+    uint32_t idHash;           // FNV-1a hash of the stream ID
+    uint64_t timestamp;        // Microseconds since the epoch, monotonic
+    uint32_t sequence;         // Frame counter, wraps around
+    uint32_t frameLength;      // Samples per channel
+    uint16_t dimensions;       // Number of channels
+    uint16_t reserved;
+    uint32_t payloadLength;    // Bytes following the header
+} Stream_header_t;
+
+/*
+ * This is the frame ring of a Stream
+ * Fixed slots of a header plus a frame, handed out in order
+ * Shared with hiredis while frames are in flight, so it is refcounted
+ */
+
+typedef struct Stream_ring_s {
+    int refs;          // The stream plus every frame in flight
+    int slots;         // Number of slots
+    int next;          // Next slot to hand out
+    size_t slotSize;   // Bytes per slot, padded so every slot stays aligned
+    size_t length;     // Bytes of header plus frame, what a slot sends
+    char *busy;        // Whether each slot is acquired or in flight
+    char *data;        // The slots, each one led by a pointer to the ring
+} Stream_ring_t;
+
+/*
+ * A frame held back while the context is congested
+ * Its header is filled already, so the sequence keeps counting while dropping
+ */
+
+typedef struct Stream_held_s {
+    Stream_header_t header;
+    const char *data;          // The frame, or its whole ring slot
+    size_t length;
+    bool inSlot;               // The header already sits in front of data
+    void (*release)(void *data, void *priv);
+    void *priv;
+} Stream_held_t;
+
+/*
+ * Frame counters of a Stream
+ * Every frame handed to sendFrame or commitFrame ends up in exactly one
+ */
+
+typedef struct Stream_stats_s {
+    uint64_t sent;             // Frames queued in Redis' context
+    uint64_t dropped;          // Frames thrown away, see Stream_policy_t
+    uint64_t coalesced;        // Frames replaced by a later one
+    uint64_t blocked;          // Polls skipped, not frames
+} Stream_stats_t;
+
 /*
  * This is the Stream dictionary
  * The attributes are predefined
@@ -38,22 +189,93 @@ typedef struct Stream_s {
     int frameLength;   //
     int frameRate;     // Should put these in an associative array
     int dimensions;    //
+    int sampleType;    // Stream_sample_t
+    int layout;        // Stream_layout_t
     char *id;
+    uint32_t idHash;   // Goes into every frame header
+    uint32_t sequence; // Sequence number of the next frame
+    char *pipe;        // Cached "stream:<id>:pipe" channel name
     redisAsyncContext *redisContext;
     void (*onCreated)(struct Stream_s *);
     void (*onUpdated)(struct Stream_s *);
     void (*onPolled)( struct Stream_s *);
-    struct event timer;
-    struct timeval interval;
+    Ticker_entry_t ticker;     // Registration in the group at frameRate,
+                               // Ticker_getStats tells how late polls were
+    Ticker_policy_t tickPolicy; // What to do with late polls
+    struct timeval interval;   // Nominal period, informative only
+    Stream_ring_t *ring;       // Frame slots, NULL until the first acquire
+    Stream_policy_t policy;    // What to do while congested
+    Stream_held_t backlog[STREAM_BACKLOG];
+    int backlogFirst;          // Oldest held frame
+    int backlogCount;          // Frames held
+    Stream_stats_t stats;
+    struct Stream_s *route;    // Next stream in the same routing bucket
+    uint32_t dirty;            // Bit per attribute not sent to Redis yet,
+                               // Entity's changedAttrs in bitmask form
+    struct event flush;        // Sends them on the next loop iteration
+    json_writer events;        // Feed events are written here, the buffer
+                               // is kept from one event to the next
     void *priv;
 } Stream_t;
 
+/*
+ * This is the routing table of a subscribe context
+ * The context subscribes once to every feed, with a pattern, and messages
+ * find their stream through the hash of the ID in the channel name
+ */
+
+typedef struct Stream_router_s {
+    redisAsyncContext *subs;
+    int size;                          // Buckets, a power of two
+    int count;                         // Streams routed
+    Stream_t **buckets;                // Chained through Stream_t.route
+    struct Stream_router_s *next;
+} Stream_router_t;
+
 /*
  * Define the Stream callback type, just for convenience
  */
 
 typedef void (*Stream_cb_f)(struct Stream_s *);
 
+/*
+ * Callback of Stream_createMany, gets back the streams it was given
+ */
+
+typedef void (*Stream_batch_f)(struct Stream_s **streams, int count,
+                               void *priv);
+
+/*
+ * Release callback for frames sent without copying
+ * Gets the frame back once it has been written to the socket
+ */
+
+typedef void (*Stream_release_f)(void *data, void *priv);
+
+/*
+ * Size helpers for frames
+ * Offsets are in samples, from the start of the frame
+ */
+
+static inline size_t Stream_sampleSize (int sampleType)
+{
+    return sampleType == STREAM_I16 ? 2 : sampleType == STREAM_F32 ? 4 : 1;
+}
+
+static inline size_t Stream_frameSize (const struct Stream_s *s)
+{
+    return (size_t) s->frameLength * s->dimensions
+                                   * Stream_sampleSize(s->sampleType);
+}
+
+static inline size_t Stream_sampleOffset (const struct Stream_s *s,
+                                          int sample, int channel)
+{
+    if (s->layout == STREAM_PLANAR)
+        return (size_t) channel * s->frameLength + sample;
+    return (size_t) sample * s->dimensions + channel;
+}
+
 /*
  * Create a new Stream instance
  * Allocates and inits the dictionary, and sends everything to Redis
@@ -67,9 +289,28 @@ Stream_t* Stream_create (
     Stream_cb_f callback        // Callback to call when Redis acknowleges
 );
 
+/*
+ * Create many Stream instances at once
+ * A single transaction registers all of them with one SADD, so startup
+ * costs one round trip whatever the count
+ * One create event on stream:feed carries every stream, keyed by ID
+ * The array must stay around until callback gets it, onCreated is not used
+ */
+
+int Stream_createMany (
+    redisAsyncContext *c,       // Redis context to use (update & publish)
+    redisAsyncContext *subs,    // Redis context to use (subscribe)
+    char **ids,                 // IDs of the new streams
+    int count,                  // Number of IDs
+    Stream_t **streams,         // Filled with the new streams
+    Stream_batch_f callback,    // Called once Redis acknowledges them all
+    void *priv                  // Passed to the callback
+);
+
 /*
  * Update one attribute of a Stream
- * Modifies the Stream and sends everything to Redis
+ * Modifies the Stream right away, Redis and the feed get every attribute
+ * changed during this loop iteration in one HMSET and one update event
  */
 
 int Stream_update (
@@ -80,7 +321,8 @@ int Stream_update (
 
 /*
  * Send a data frame to the clients
- * Adds the required headers and publishes it to Redis
+ * Adds the frame header and publishes it to Redis
+ * Takes ownership of data, which is freed once it has been sent
  */
 
 int Stream_sendFrame (
@@ -89,6 +331,72 @@ int Stream_sendFrame (
     size_t length               // Length of the array
 );
 
+/*
+ * Send a data frame without copying it
+ * The frame is written straight from the given buffer, which must stay
+ * untouched until release is called with it
+ */
+
+int Stream_sendFrameNoCopy (
+    Stream_t *s,                // Stream to update
+    char *data,                 // Byte array containing the actual frame
+    size_t length,              // Length of the array
+    Stream_release_f release,   // Called when the frame has been sent
+    void *priv                  // Passed to the release callback
+);
+
+/*
+ * Get a free frame from the stream's ring
+ * The frame holds Stream_frameSize bytes and must be committed
+ * Returns NULL when every slot is still in flight
+ */
+
+char* Stream_acquireFrame (
+    Stream_t *s                 // Stream to get the frame from
+);
+
+/*
+ * Send a frame obtained with acquireFrame
+ * The slot goes back to the ring once it has been written
+ * A frame acquired before the frame size changed is dropped, returns 1
+ */
+
+int Stream_commitFrame (
+    Stream_t *s,                // Stream to send from
+    char *frame                 // Frame returned by acquireFrame
+);
+
+/*
+ * Choose what happens to frames while the Redis context is congested
+ * Held frames that can't be sent right away are dropped
+ */
+
+int Stream_setPolicy (
+    Stream_t *s,                // Stream to configure
+    Stream_policy_t policy      // See Stream_policy_t
+);
+
+/*
+ * Send the frames held while the context was congested
+ * Called on every poll, and worth calling from the drain callback
+ * Returns the number of frames still held
+ */
+
+int Stream_flush (
+    Stream_t *s                 // Stream to flush
+);
+
+/*
+ * Send attribute updates through a server-side script
+ * One EVALSHA writes the fields and publishes the update event, the script
+ * is loaded on c and plain EVAL goes out until then or after a NOSCRIPT
+ */
+
+int Stream_useScripts (
+    redisAsyncContext *c,       // Redis context to load the script on
+    bool enable                 // Whether to use it from now on
+);
+
 /*
  * Publish a message to everybody listening to the streams
  * This is used internally to notifiy other clients of every action
@@ -100,9 +408,33 @@ int Stream_publishEvent (
     char *data                  // JSON-encoded message
 );
 
+/*
+ * Find which name a feed message key is
+ * Returns STREAM_ATTR_UNKNOWN for anything that is not in Stream_attr_t
+ */
+
+Stream_attr_t Stream_lookupAttr (
+    const char *name,           // Key, not necessarily NUL-terminated
+    size_t len                  // Length of the key
+);
+
+/*
+ * Scan a feed message without building a JSON tree or allocating
+ * Stops as soon as the message turns out to be ours or not an update, or
+ * carries a value that doesn't fit an int
+ * Returns 0 when feed holds an update from another client, 1 otherwise
+ */
+
+int Stream_scanFeed (
+    const char *str,            // Raw message
+    size_t len,                 // Length of the message
+    Stream_feed_t *feed         // Filled with what the message carries
+);
+
 /*
  * Start the timer and call onPolled for updates
  * Avoid writing a timer if data is not being pushed to save dev time
+ * Streams at the same frameRate share a timer and are polled together
  */
 
 int Stream_startPolling (
@@ -118,4 +450,14 @@ int Stream_stopPolling (
     Stream_t *s                 // Stream to stop polling from
 );
 
+/*
+ * Choose what happens to polls whose deadline has passed
+ * Defaults to TICKER_CATCHUP, a polling stream moves to its new group
+ */
+
+int Stream_setTickPolicy (
+    Stream_t *s,                // Stream to configure
+    Ticker_policy_t policy      // See Ticker_policy_t
+);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,242 @@
+#include <time.h>
+
+#include "ticker.h"
+
+/***********************
+ ** PRIVATE FUNCTIONS **
+ ***********************/
+
+static void _onTimeout (int fd, short ev, void *priv);
+
+static Ticker_group_t* _group_get (int rate, Ticker_policy_t policy);
+
+static void _group_free (Ticker_group_t *g);
+
+static uint64_t _now (void);
+
+static uint64_t _deadline (Ticker_group_t *g, uint64_t tick);
+
+static void _schedule (Ticker_group_t *g, uint64_t now);
+
+static void _late (Ticker_group_t *g, uint64_t missed);
+
+
+/*
+ * Every group alive, there is one per distinct rate
+ */
+
+static Ticker_group_t *groups = NULL;
+
+
+/********************
+ ** IMPLEMENTATION **
+ ********************/
+
+/*
+ * Main methods
+ */
+
+int Ticker_add (Ticker_entry_t *e,
+                int rate,
+                Ticker_policy_t policy,
+                Ticker_cb_f callback,
+                void *priv)
+{
+    Ticker_group_t *g;
+
+    if (rate <= 0) return 1;
+
+    g = _group_get(rate, policy);
+    if (g == NULL) return 1;
+
+    e->callback = callback;
+    e->priv = priv;
+    e->group = g;
+    e->prev = NULL;
+    e->next = g->head;
+    if (g->head != NULL) g->head->prev = e;
+    g->head = e;
+    g->count++;
+
+    return 0;
+}
+
+
+int Ticker_remove (Ticker_entry_t *e)
+{
+    Ticker_group_t *g = e->group;
+
+    if (g == NULL) return 1;
+
+    if (g->cursor == e) g->cursor = e->next;
+    if (e->prev != NULL) e->prev->next = e->next;
+    else g->head = e->next;
+    if (e->next != NULL) e->next->prev = e->prev;
+    e->group = NULL;
+    e->prev = e->next = NULL;
+
+    // A group that is dispatching frees itself when it is done
+    if (--g->count == 0 && !g->dispatching) {
+        _group_free(g);
+    }
+
+    return 0;
+}
+
+
+void Ticker_getStats (const Ticker_entry_t *e,
+                      Ticker_stats_t *out)
+{
+    *out = e->stats;
+}
+
+
+/*
+ * Callbacks
+ */
+
+void _onTimeout (int fd,
+                 short ev,
+                 void *priv)
+{
+    Ticker_group_t *g = (Ticker_group_t*) priv;
+    Ticker_schedule_t *sch = &(g->schedule);
+    Ticker_entry_t *e;
+    uint64_t now, next, due, missed = 0;
+
+    // Everybody at this rate runs from this single wakeup
+    g->dispatching = true;
+    for (e = g->head; e != NULL; e = g->cursor) {
+        g->cursor = e->next;
+        e->callback(e->priv);
+    }
+    g->cursor = NULL;
+    g->dispatching = false;
+
+    if (g->count == 0) {
+        _group_free(g);
+        return;
+    }
+
+    // Move tick 0 forward every whole second to keep the products small
+    sch->ticks++;
+    if (sch->ticks >= (uint64_t) g->rate) {
+        sch->start += sch->ticks / g->rate * 1000000000ULL;
+        sch->ticks %= g->rate;
+    }
+
+    now = _now();
+    next = _deadline(g, sch->ticks);
+
+    if (now > next) {
+        // Go straight to the first deadline ahead when too far behind
+        if (g->policy == TICKER_SKIP ||
+            now - next > TICKER_MAX_CATCHUP * 1000000000ULL / g->rate) {
+            due = (now - sch->start) * g->rate / 1000000000ULL;
+            missed = due + 1 - sch->ticks;
+            sch->ticks = due + 1;
+        }
+
+        _late(g, missed);
+    }
+
+    _schedule(g, now);
+}
+
+
+/*
+ * Groups
+ */
+
+Ticker_group_t* _group_get (int rate,
+                            Ticker_policy_t policy)
+{
+    Ticker_group_t *g;
+    uint64_t now;
+
+    for (g = groups; g != NULL; g = g->next) {
+        if (g->rate == rate && g->policy == policy) return g;
+    }
+
+    g = (Ticker_group_t*) calloc(1, sizeof(Ticker_group_t));
+    if (g == NULL) return NULL;
+
+    g->rate = rate;
+    g->policy = policy;
+    g->next = groups;
+    groups = g;
+
+    // First tick one period from now, like a plain interval timer
+    now = _now();
+    g->schedule.start = now;
+    g->schedule.ticks = 1;
+
+    event_set(&(g->timer), -1, EV_TIMEOUT, _onTimeout, g);
+    _schedule(g, now);
+
+    return g;
+}
+
+
+void _group_free (Ticker_group_t *g)
+{
+    Ticker_group_t **p;
+
+    for (p = &groups; *p != NULL; p = &((*p)->next)) {
+        if (*p == g) {
+            *p = g->next;
+            break;
+        }
+    }
+
+    event_del(&(g->timer));
+    free(g);
+}
+
+
+/*
+ * Scheduling
+ */
+
+uint64_t _now (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+// Exact for any rate, the division happens after the multiplication
+uint64_t _deadline (Ticker_group_t *g,
+                    uint64_t tick)
+{
+    return g->schedule.start + tick * 1000000000ULL / g->rate;
+}
+
+
+// Only runs behind schedule, on time the entries are not touched
+void _late (Ticker_group_t *g,
+            uint64_t missed)
+{
+    Ticker_entry_t *e;
+
+    for (e = g->head; e != NULL; e = e->next) {
+        e->stats.overruns++;
+        e->stats.missed += missed;
+    }
+}
+
+
+void _schedule (Ticker_group_t *g,
+                uint64_t now)
+{
+    uint64_t next = _deadline(g, g->schedule.ticks);
+    uint64_t wait = next > now ? next - now : 0;
+    struct timeval tv;
+
+    // Round up, waking early would only mean ticking twice in a row
+    wait = (wait + 999) / 1000;
+    tv.tv_sec = wait / 1000000;
+    tv.tv_usec = wait % 1000000;
+    event_add(&(g->timer), &tv);
+}
@@ -0,0 +1,126 @@
+/*
+ * TICKER class
+ * Shares one timer between everything that ticks at the same rate
+ * Streams register here when they start polling, so N streams at one
+ * frameRate cost a single libevent timer and a single wakeup per tick
+ */
+
+#ifndef __TICKER_H__
+#define __TICKER_H__
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <event.h>
+
+/*
+ * Define some compile-time constants
+ */
+
+#ifndef TICKER_MAX_CATCHUP
+ #define TICKER_MAX_CATCHUP 16    // Late ticks run back to back before skipping
+#endif
+
+/*
+ * What to do with ticks whose deadline has already passed
+ */
+
+typedef enum {
+    TICKER_CATCHUP,            // Run them back to back, up to TICKER_MAX_CATCHUP
+    TICKER_SKIP                // Drop them and wait for the next deadline
+} Ticker_policy_t;
+
+/*
+ * Define the Ticker callback type, just for convenience
+ */
+
+typedef void (*Ticker_cb_f)(void *priv);
+
+/*
+ * This is the schedule of a group
+ * Deadlines are absolute, start + ticks / rate on the monotonic clock,
+ * so rounding never accumulates into drift
+ */
+
+typedef struct Ticker_schedule_s {
+    uint64_t start;            // Monotonic time of tick 0, in nanoseconds
+    uint64_t ticks;            // Index of the tick that is scheduled next
+} Ticker_schedule_t;
+
+/*
+ * Late ticks an entry has been through, across every group it was in
+ */
+
+typedef struct Ticker_stats_s {
+    uint64_t overruns;         // Dispatches that ended past the next deadline
+    uint64_t missed;           // Ticks dropped without dispatching
+} Ticker_stats_t;
+
+/*
+ * This is a registration in a group
+ * Meant to be embedded in whatever ticks, so registering never allocates
+ * Zero it once, the stats are kept when it is removed and added again
+ */
+
+typedef struct Ticker_entry_s {
+    Ticker_cb_f callback;
+    void *priv;
+    Ticker_stats_t stats;
+    struct Ticker_group_s *group;      // NULL when not registered
+    struct Ticker_entry_s *prev;
+    struct Ticker_entry_s *next;
+} Ticker_entry_t;
+
+/*
+ * This is the set of entries ticking at one rate under one policy
+ * Created on the first registration, freed with the last one
+ */
+
+typedef struct Ticker_group_s {
+    int rate;                          // Ticks per second
+    Ticker_policy_t policy;            // What to do with late ticks
+    int count;                         // Registered entries
+    bool dispatching;                  // Inside the timer callback
+    struct event timer;
+    Ticker_schedule_t schedule;
+    Ticker_entry_t *head;
+    Ticker_entry_t *cursor;            // Next entry to dispatch
+    struct Ticker_group_s *next;
+} Ticker_group_t;
+
+/*
+ * Register an entry at the given rate
+ * The entry is called once per tick until removed
+ * Entries with the same rate and policy share a group
+ */
+
+int Ticker_add (
+    Ticker_entry_t *e,          // Entry to register, must not be registered
+    int rate,                   // Ticks per second
+    Ticker_policy_t policy,     // What to do with late ticks
+    Ticker_cb_f callback,       // Called on every tick
+    void *priv                  // Passed to the callback
+);
+
+/*
+ * Unregister an entry
+ * Safe to call from any callback, and on entries that are not registered
+ */
+
+int Ticker_remove (
+    Ticker_entry_t *e           // Entry to unregister
+);
+
+/*
+ * Copy the late-tick counters of an entry
+ * Works whether it is registered or not
+ */
+
+void Ticker_getStats (
+    const Ticker_entry_t *e,    // Entry to read
+    Ticker_stats_t *out         // Filled with its counters
+);
+
+#endif
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/json.h"
+
+#define ROUNDS 200000
+
+/*
+ * A typical control message, as published by Stream_update
+ */
+
+static const char control[] = "{"
+    "\"clientID\": \"web_client\","
+    "\"method\": \"update\","
+    "\"data\": {"
+        "\"frameLength\": 1024,"
+        "\"frameRate\": 60,"
+        "\"dimensions\": 2,"
+        "\"label\": \"left and right\""
+    "}"
+"}";
+
+/*
+ * An entity update with long text attributes, indented like the web
+ * client sends it
+ */
+
+static const char metadata[] = "{\n"
+    "    \"clientID\": \"web_client\",\n"
+    "    \"method\": \"update\",\n"
+    "    \"data\": {\n"
+    "        \"name\": \"Violin recording, second take\",\n"
+    "        \"description\": \"Solo violin recorded with two microphones "
+        "placed at one and three metres, together with bow position and "
+        "pressure from the motion capture system. The performer plays the "
+        "first movement twice, once at the written tempo and once slower, "
+        "and every take is annotated with note onsets and bow changes.\",\n"
+    "        \"labels\": [\"violin\", \"solo\", \"motion capture\", "
+        "\"bowing\", \"second take\"],\n"
+    "        \"author\": \"Music Technology Group\",\n"
+    "        \"frameRate\": 100\n"
+    "    }\n"
+"}\n";
+
+/*
+ * HELPERS
+ */
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+void report(const char *name, size_t length, double elapsed)
+{
+    printf("  %-8s %8.1f ns/message  %8.1f MB/s\n",
+           name, elapsed * 1e9 / ROUNDS, length * ROUNDS / elapsed / 1e6);
+}
+
+
+int run(const char *title, const char *message, json_scan_mode mode)
+{
+    static const char *scanners[] = { "auto", "scalar", "sse2", "avx2" };
+    size_t length = strlen(message);
+    json_settings settings;
+    json_arena arena;
+    json_sax_handler handler;
+    json_value *value;
+    double start;
+    int i;
+
+    // Skipped when the CPU falls back to a scanner that ran already
+    if (json_scan_use(mode) != mode) return 0;
+
+    printf("%s, %zu bytes, %s scanner\n", title, length, scanners[mode]);
+
+    // Every value comes from malloc and goes back with json_value_free
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        value = json_parse(message, length);
+        if (value == NULL) return 1;
+        json_value_free(value);
+    }
+    report("malloc", length, now() - start);
+
+    // Every value comes from the arena, which is reset after each message
+
+    memset(&settings, 0, sizeof(settings));
+    if (!json_arena_init(&arena, 1024)) return 1;
+    json_arena_settings(&arena, &settings);
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        value = json_parse_ex(&settings, message, length, NULL);
+        if (value == NULL) return 1;
+        json_arena_reset(&arena);
+    }
+    report("arena", length, now() - start);
+
+    json_arena_free(&arena);
+
+    // No tree at all, for reference
+
+    memset(&handler, 0, sizeof(handler));
+
+    start = now();
+    for (i = 0; i < ROUNDS; i++) {
+        if (json_sax_parse(&handler, message, length, NULL) != json_sax_done) {
+            return 1;
+        }
+    }
+    report("sax", length, now() - start);
+
+    return 0;
+}
+
+
+/*
+ * MAIN
+ */
+
+int main (int argc, char **argv)
+{
+    json_scan_mode mode;
+
+    // The same messages through every scanner, scalar first
+    for (mode = json_scan_scalar; mode <= json_scan_avx2; mode++) {
+        if (run("Control message", control, mode) != 0) return 1;
+        if (run("Entity metadata", metadata, mode) != 0) return 1;
+    }
+
+    json_scan_use(json_scan_auto);
+    return 0;
+}
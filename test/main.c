@@ -49,7 +49,9 @@ void onTimeout(Stream_t *s)
 {
     int i = 0;
     int len = s->frameLength;
-    char *data = malloc(len);
+    char *data = Stream_acquireFrame(s);
+
+    if (data == NULL) return; // Every frame is still in flight
 
     for (i = 0; i < len; i++) {
         int r = ((double)rand() * 32) / RAND_MAX;
@@ -59,7 +61,13 @@ void onTimeout(Stream_t *s)
         data[i] = (char) floor(sig);
     }
 
-    Stream_sendFrame(s, data, len);
+    Stream_commitFrame(s, data);
+}
+
+
+void onDrained(redisAsyncContext *c, void *priv)
+{
+    Stream_flush((Stream_t*) priv);
 }
 
 
@@ -91,15 +99,31 @@ int main (int argc, char **argv)
     redisAsyncSetConnectCallback(c,onConnect);
     redisAsyncSetDisconnectCallback(c,onDisconnect);
 
+    // Frames polled on the same tick leave in one write, or sooner past 64KB
+    redisAsyncSetBatching(c, 1, 64 * 1024, 0);
+
+    // Frames and updates don't wait for replies, don't build them either
+    redisAsyncSetDiscard(c, 1);
+
+    // Attribute updates write the hash and notify in a single EVALSHA
+    Stream_useScripts(c, true);
+
     redisLibeventAttach(subs,base);
     redisAsyncSetConnectCallback(subs,onConnect);
     redisAsyncSetDisconnectCallback(subs,onDisconnect);
 
+    // Feed messages all look alike, recycle their replies instead of mallocing
+    redisReaderSetPooling(subs->c.reader, 1);
+
     // INIT SOURCE
 
     Stream_t *s = Stream_create(c, subs, "c_stream", onCreated);
     s->onPolled = onTimeout;
 
+    // Past 1MB queued the newest frame waits, and goes out once under 256KB
+    Stream_setPolicy(s, STREAM_COALESCE);
+    redisAsyncSetWatermarks(c, 1024 * 1024, 256 * 1024, onDrained, s);
+
     // START
 
     event_base_dispatch(base);
@@ -0,0 +1,332 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <hiredis/hiredis.h>
+#include <hiredis/async.h>
+
+#include "../src/stream.h"
+
+/*
+ * Nothing here needs a server: commands pile up in the output buffer of a
+ * context that never gets to connect
+ */
+
+/*
+ * Scans an update from some other client carrying _data
+ */
+
+#define OTHER "{\"clientID\":\"other\",\"method\":\"update\",\"data\":"
+#define SCAN_OTHER(_data, _feed) \
+    Stream_scanFeed(OTHER _data, sizeof(OTHER _data) - 1, _feed)
+
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+
+/*
+ * TESTS
+ */
+
+void test_ring_resize(redisAsyncContext *c, redisAsyncContext *subs)
+{
+    Stream_t *s = Stream_create(c, subs, "test_ring", NULL);
+    Stream_ring_t *ring;
+    char *first, *second, *frame;
+
+    first = Stream_acquireFrame(s);
+    second = Stream_acquireFrame(s);
+    ring = s->ring;
+
+    Stream_update(s, "frameLength", 64);
+
+    test("Drops a frame acquired before a resize: ");
+    test_cond(s->ring == NULL &&
+              Stream_commitFrame(s, first) == 1 &&
+              s->stats.dropped == 1);
+
+    test("Hands the slot back to the old ring: ");
+    test_cond(ring->refs == 1 && ring->busy[0] == 0 && ring->busy[1] == 1);
+
+    // The last frame of the old ring frees it, ASan tells if it doesn't
+    Stream_commitFrame(s, second);
+
+    frame = Stream_acquireFrame(s);
+
+    test("Sends frames of the new size: ");
+    test_cond(frame != NULL && s->ring->slotSize > 64 &&
+              Stream_commitFrame(s, frame) == 0 &&
+              s->stats.sent == 1 && s->stats.dropped == 2);
+}
+
+
+void test_odd_frames(redisAsyncContext *c, redisAsyncContext *subs)
+{
+    Stream_t *s = Stream_create(c, subs, "test_odd", NULL);
+    int i, aligned = 1, committed = 0;
+    char *frame;
+
+    // U8 frames of 1 and then 3 bytes, every slot past the first is odd
+    // unless the ring pads them
+    for (i = 0; i < 2 * STREAM_FRAME_SLOTS; i++) {
+        if (i == STREAM_FRAME_SLOTS) Stream_update(s, "frameLength", 3);
+
+        frame = Stream_acquireFrame(s);
+        if (frame == NULL) break;
+        aligned &= ((uintptr_t) frame % 8) == 0;
+        memset(frame, i, Stream_frameSize(s));
+        committed += Stream_commitFrame(s, frame) == 0;
+    }
+
+    test("Keeps odd-sized frames and their headers aligned: ");
+    test_cond(aligned && committed == 2 * STREAM_FRAME_SLOTS &&
+              s->stats.sent == 2 * STREAM_FRAME_SLOTS);
+
+    test("Sends only the header and the frame of a padded slot: ");
+    test_cond(s->ring->length == sizeof(Stream_header_t) + 3 &&
+              s->ring->slotSize % 8 == 0);
+}
+
+
+void test_tick_policy(redisAsyncContext *c, redisAsyncContext *subs)
+{
+    Stream_t *a = Stream_create(c, subs, "test_catchup", NULL);
+    Stream_t *b = Stream_create(c, subs, "test_skip", NULL);
+
+    Stream_startPolling(a);
+    Stream_startPolling(b);
+
+    test("Streams at one rate share a group: ");
+    test_cond(a->ticker.group != NULL && a->ticker.group == b->ticker.group);
+
+    Stream_setTickPolicy(b, TICKER_SKIP);
+
+    test("Each policy gets its own group: ");
+    test_cond(b->ticker.group != NULL && b->ticker.group != a->ticker.group &&
+              b->ticker.group->policy == TICKER_SKIP &&
+              a->ticker.group->policy == TICKER_CATCHUP);
+
+    Stream_stopPolling(a);
+    Stream_stopPolling(b);
+}
+
+
+void test_bad_attrs(redisAsyncContext *c, redisAsyncContext *subs)
+{
+    Stream_t *s = Stream_create(c, subs, "test_attrs", NULL);
+    Stream_feed_t feed;
+
+    test("Turns down sizes that are not positive: ");
+    test_cond(Stream_update(s, "frameLength", 0) == 1 &&
+              Stream_update(s, "frameLength", -256) == 1 &&
+              Stream_update(s, "dimensions", -1) == 1);
+
+    Stream_update(s, "sampleType", STREAM_F32);
+
+    test("Turns down frames larger than STREAM_MAX_FRAME: ");
+    test_cond(Stream_update(s, "frameLength", 0x7fffffff) == 1 &&
+              Stream_update(s, "dimensions", 65535) == 0 &&
+              Stream_update(s, "frameLength", 65536) == 1 &&
+              Stream_update(s, "dimensions", 65536) == 1);
+
+    test("Turns down unknown sample types and layouts: ");
+    test_cond(Stream_update(s, "sampleType", 3) == 1 &&
+              Stream_update(s, "sampleType", -1) == 1 &&
+              Stream_update(s, "layout", 2) == 1);
+
+    test("Turns down feed values that don't fit an int: ");
+    test_cond(SCAN_OTHER("{\"frameLength\":4294967297}}", &feed) == 1 &&
+              SCAN_OTHER("{\"dimensions\":-2147483649}}", &feed) == 1 &&
+              SCAN_OTHER("{\"frameLength\":2147483647}}", &feed) == 0 &&
+              feed.values[STREAM_ATTR_FRAME_LENGTH] == INT_MAX);
+
+    test("Leaves the stream as it was: ");
+    test_cond(s->frameLength == 1 && s->dimensions == 65535 &&
+              s->sampleType == STREAM_F32 &&
+              s->layout == STREAM_INTERLEAVED &&
+              Stream_frameSize(s) == 65535 * 4);
+}
+
+
+// Exported by async.c, not declared in async.h
+void redisProcessCallbacks(redisAsyncContext *ac);
+
+static int updates = 0;
+
+void onUpdatedCount(Stream_t *s)
+{
+    updates++;
+}
+
+
+// Hands subs a message on the feed of id, as if the server had sent it
+void deliver(redisAsyncContext *subs, const char *id, const char *payload)
+{
+    char channel[64], buf[512];
+    int len;
+
+    snprintf(channel, sizeof(channel), "stream:%s:feed", id);
+    len = snprintf(buf, sizeof(buf),
+                   "*4\r\n$8\r\npmessage\r\n$13\r\nstream:*:feed\r\n"
+                   "$%zu\r\n%s\r\n$%zu\r\n%s\r\n",
+                   strlen(channel), channel, strlen(payload), payload);
+
+    redisReaderFeed(subs->c.reader, buf, len);
+    redisProcessCallbacks(subs);
+}
+
+
+void test_whole_update(redisAsyncContext *c, redisAsyncContext *subs)
+{
+    Stream_t *s = Stream_create(c, subs, "test_whole", NULL);
+
+    s->onUpdated = onUpdatedCount;
+    Stream_update(s, "sampleType", STREAM_F32);
+    Stream_update(s, "dimensions", 65535);
+
+    // One at a time, 1024 frames of 65535 floats are too large
+    deliver(subs, "test_whole", OTHER "{\"frameLength\":1024,"
+                                      "\"dimensions\":2}}");
+
+    test("Checks the attributes of a message together: ");
+    test_cond(s->frameLength == 1024 && s->dimensions == 2 && updates == 1);
+
+    deliver(subs, "test_whole", OTHER "{\"dimensions\":1,"
+                                      "\"frameLength\":0}}");
+
+    test("Turns down a message as a whole: ");
+    test_cond(s->frameLength == 1024 && s->dimensions == 2 && updates == 1);
+}
+
+
+// Hands c the next reply, as if the server had sent it
+void answer(redisAsyncContext *c, const char *reply)
+{
+    redisReaderFeed(c->c.reader, reply, strlen(reply));
+    redisProcessCallbacks(c);
+}
+
+
+void test_noscript(redisAsyncContext *subs)
+{
+    redisAsyncContext *c = redisAsyncConnect("127.0.0.1", 6379);
+    Stream_t *s = Stream_create(c, subs, "test_noscript", NULL);
+    const char *resent;
+
+    while (c->replies.pending > 0) answer(c, "+OK\r\n");
+    Stream_useScripts(c, true);
+    answer(c, "$40\r\n0123456789012345678901234567890123456789\r\n");
+
+    // Two updates on the wire as EVALSHA, the first one bounces
+    Stream_update(s, "frameLength", 4);
+    event_loop(EVLOOP_NONBLOCK);
+    Stream_update(s, "frameLength", 8);
+    event_loop(EVLOOP_NONBLOCK);
+    answer(c, "-NOSCRIPT No matching script\r\n");
+
+    test("Sends a bounced update again on the next flush: ");
+    test_cond(s->dirty == (1u << STREAM_ATTR_FRAME_LENGTH) &&
+              strstr(c->c.obuf, "\r\nEVAL\r\n") == NULL);
+
+    answer(c, "-NOSCRIPT No matching script\r\n");
+    event_loop(EVLOOP_NONBLOCK);
+    resent = strstr(c->c.obuf, "\r\nEVAL\r\n");
+
+    test("Sends the latest values as EVAL, and hears back: ");
+    test_cond(resent != NULL && strstr(resent, "\r\n$1\r\n8\r\n") != NULL &&
+              strstr(resent, "\r\n$1\r\n4\r\n") == NULL &&
+              s->dirty == 0 && c->replies.count > 0 && c->replies.skip == 0);
+
+    Stream_useScripts(c, false);
+    redisAsyncFree(c);
+}
+
+
+void test_create_many(redisAsyncContext *subs)
+{
+    static char *ids[3] = { "test_many_a", "test_many_b", "test_many_c" };
+    static Stream_t *streams[3];
+    redisAsyncContext *c = redisAsyncConnect("127.0.0.1", 6379);
+    const char *out, *event;
+
+    Stream_createMany(c, subs, ids, 3, streams, NULL, NULL);
+    out = c->c.obuf;
+    event = strstr(out, "\r\nstream:feed\r\n");
+
+    test("Announces a batch in one create event: ");
+    // The only feed published to is the one of the set
+    test_cond(event != NULL &&
+              strstr(out, ":feed\r\n") == event + strlen("\r\nstream") &&
+              strstr(event + strlen("\r\nstream:feed"), ":feed\r\n") == NULL &&
+              strstr(event, "\"test_many_a\":{\"frameLength\":1,") != NULL &&
+              strstr(event, "\"test_many_c\":{") != NULL);
+
+    redisAsyncFree(c);
+}
+
+
+void onSlowPoll(Stream_t *s)
+{
+    usleep(25000);
+}
+
+
+void test_late_polls(redisAsyncContext *c, redisAsyncContext *subs)
+{
+    Stream_t *s = Stream_create(c, subs, "test_late", NULL);
+    Ticker_stats_t stats;
+    int i;
+
+    s->onPolled = onSlowPoll;
+    Stream_update(s, "frameRate", 100);
+    Stream_setTickPolicy(s, TICKER_SKIP);
+    Stream_startPolling(s);
+
+    for (i = 0; i < 3; i++) event_loop(EVLOOP_ONCE);
+
+    // The group goes away with its last stream, the counts don't
+    Stream_stopPolling(s);
+    Ticker_getStats(&(s->ticker), &stats);
+
+    test("Counts late and skipped polls per stream: ");
+    test_cond(s->ticker.group == NULL &&
+              stats.overruns >= 2 && stats.missed >= 2);
+}
+
+
+int main(void)
+{
+    redisAsyncContext *c, *subs;
+
+    event_init();
+
+    c = redisAsyncConnect("127.0.0.1", 6379);
+    subs = redisAsyncConnect("127.0.0.1", 6379);
+    if (c == NULL || subs == NULL || c->err || subs->err) {
+        printf("Could not create the contexts\n");
+        return 1;
+    }
+
+    test_ring_resize(c, subs);
+    test_odd_frames(c, subs);
+    test_tick_policy(c, subs);
+    test_bad_attrs(c, subs);
+    test_whole_update(c, subs);
+    test_late_polls(c, subs);
+    test_create_many(subs);
+    test_noscript(subs);
+
+    if (fails == 0) {
+        printf("ALL TESTS PASSED\n");
+    } else {
+        printf("*** %d TESTS FAILED ***\n", fails);
+    }
+
+    redisAsyncFree(c);
+    redisAsyncFree(subs);
+    return fails > 0;
+}